@@ -0,0 +1,228 @@
+#ifndef _STATIC_STRING_TRIE_H_
+#define _STATIC_STRING_TRIE_H_
+
+#include <stddef.h>
+#include <array>
+#include <utility>
+#include <string_view>
+#include <type_traits>
+
+/******************************************************************************************
+ * static_stringtrie
+ *
+ * A radix trie over a list of keys and values that is known when the program is compiled,
+ * such as FIX tag names, exchange codes or message types. The trie is built by the
+ * compiler, so it costs nothing at startup, has no heap nodes and lives in read only data.
+ * It needs C++17.
+ *
+ * The list is an array of pairs with static storage, the trie is a type named after it:
+ *
+ *     constexpr std::pair<std::string_view, int> fixtags[] = {
+ *         {"BeginString", 8}, {"BodyLength", 9}, {"MsgType", 35}, ...
+ *     };
+ *     typedef static_stringtrie<fixtags> fixtag_trie;
+ *
+ *     fixtag_trie::const_iterator it = fixtag_trie::find(name);
+ *     if (it != fixtag_trie::end())
+ *         tag = it->second;
+ *
+ * find() has the same semantics as stringtrie::find(), an exact match or end(). If a key is
+ * in the list more than once the first one wins, the same as stringtrie::insert().
+ * begin() to end() visits the keys in order. find() is constexpr, so a lookup of a
+ * constant key is done by the compiler.
+ *
+ * The nodes are laid out in flat arrays: each node is a part of a key, the index of its
+ * value and a range of edges, and each edge is a character and a child node. The descent
+ * is a template instantiated for each node, so the compiler sees the part of the key and
+ * the edge characters of every node as constants and turns each node into a compare
+ * with immediate values and a switch on the next character.
+ *
+ * ****************************************************************************************/
+
+namespace tt_coreutils_ns
+{
+    template<const auto& Entries>
+    struct static_stringtrie_layout
+    {
+        typedef typename std::remove_cv<typename std::remove_reference<decltype(Entries[0])>::type>::type value_type;
+        enum {
+            NUM_ENTRIES = std::extent<typename std::remove_reference<decltype(Entries)>::type>::value
+            // Every node but the root has a value or two children
+            , MAX_NODES = 2 * NUM_ENTRIES + 1
+        };
+        static constexpr size_t NOVALUE = ~(size_t)0;
+
+        struct node
+        {
+            size_t entry = 0;           // The entry the node's part of the key is taken from
+            size_t start = 0;           // The node's part of the key, the characters
+            size_t len = 0;             // [start, start + len) of the entry's key
+            size_t value = NOVALUE;     // Index into the sorted entries
+            size_t firstedge = 0;
+            size_t nedges = 0;
+        };
+
+        struct edge
+        {
+            char c = 0;                 // The character after the parent's part of the key
+            size_t child = 0;
+        };
+
+        size_t order[NUM_ENTRIES] = {};     // Entries in key order without repeats
+        size_t nunique = 0;
+        node nodes[MAX_NODES] = {};
+        size_t nnodes = 0;
+        edge edges[MAX_NODES] = {};
+        size_t nedges = 0;
+
+        static constexpr std::string_view key(size_t n)
+        {
+            return std::string_view(Entries[n].first);
+        }
+
+        static constexpr static_stringtrie_layout build()
+        {
+            static_stringtrie_layout l;
+            // Stable insertion sort, then drop repeated keys so the first one in the list wins
+            for (size_t i = 0; i < NUM_ENTRIES; ++i)
+                l.order[i] = i;
+            for (size_t i = 1; i < NUM_ENTRIES; ++i)
+            {
+                for (size_t j = i; j > 0 && key(l.order[j]) < key(l.order[j - 1]); --j)
+                {
+                    size_t tmp = l.order[j];
+                    l.order[j] = l.order[j - 1];
+                    l.order[j - 1] = tmp;
+                }
+            }
+            for (size_t i = 0; i < NUM_ENTRIES; ++i)
+            {
+                if (l.nunique == 0 || key(l.order[i]) != key(l.order[l.nunique - 1]))
+                    l.order[l.nunique++] = l.order[i];
+            }
+            l.nnodes = 1;
+            l.buildnode(0, 0, l.nunique, 0);
+            return l;
+        }
+
+        // Node n holds the sorted keys [lo, hi) which are the same up to depth. Its part of
+        // the key runs to where the first and last of them differ, the sort means all of
+        // them are the same up to there.
+        constexpr void buildnode(size_t n, size_t lo, size_t hi, size_t depth)
+        {
+            std::string_view first = key(order[lo]);
+            std::string_view last = key(order[hi - 1]);
+            size_t end = depth;
+            while (end < first.size() && end < last.size() && first[end] == last[end])
+                ++end;
+            nodes[n].entry = order[lo];
+            nodes[n].start = depth;
+            nodes[n].len = end - depth;
+            if (first.size() == end)
+                nodes[n].value = lo++;
+
+            // Children are contiguous, one for each character that follows this node
+            nodes[n].firstedge = nedges;
+            for (size_t i = lo; i < hi; )
+            {
+                char c = key(order[i])[end];
+                while (i < hi && key(order[i])[end] == c)
+                    ++i;
+                ++nodes[n].nedges;
+            }
+            nedges += nodes[n].nedges;
+
+            size_t e = nodes[n].firstedge;
+            for (size_t i = lo; i < hi; ++e)
+            {
+                char c = key(order[i])[end];
+                size_t j = i;
+                while (j < hi && key(order[j])[end] == c)
+                    ++j;
+                edges[e].c = c;
+                edges[e].child = nnodes++;
+                buildnode(edges[e].child, i, j, end + 1);
+                i = j;
+            }
+        }
+    };
+
+    template<const auto& Entries>
+    class static_stringtrie
+    {
+    public:
+        typedef static_stringtrie_layout<Entries> layout_type;
+        typedef typename layout_type::value_type value_type;
+        typedef const value_type *const_iterator;
+        typedef size_t size_type;
+
+        static_assert(layout_type::NUM_ENTRIES > 0, "static_stringtrie needs at least one key");
+
+        static constexpr layout_type layout = layout_type::build();
+
+        static constexpr const_iterator find(std::string_view key)
+        {
+            size_t n = findnode<0>(key, 0);
+            if (n == layout_type::NOVALUE)
+                return end();
+            return &sorted[n];
+        }
+
+        static constexpr size_type count(std::string_view key)
+        {
+            return find(key) == end() ? 0 : 1;
+        }
+
+        static constexpr size_type size()
+        {
+            return layout.nunique;
+        }
+
+        static constexpr const_iterator begin()
+        {
+            return sorted.data();
+        }
+
+        static constexpr const_iterator end()
+        {
+            return sorted.data() + layout.nunique;
+        }
+
+    private:
+        template<size_t... I>
+        static constexpr std::array<value_type, sizeof...(I)> makesorted(std::index_sequence<I...>)
+        {
+            return std::array<value_type, sizeof...(I)>{{ Entries[layout.order[I]]... }};
+        }
+
+        // The entries in key order, find() returns pointers into this
+        static constexpr std::array<value_type, layout.nunique> sorted = makesorted(std::make_index_sequence<layout.nunique>());
+
+        // Match node N's part of the key at pos, then follow the edge for the next character
+        template<size_t N>
+        static constexpr size_t findnode(std::string_view key, size_t pos)
+        {
+            constexpr typename layout_type::node n = layout.nodes[N];
+            constexpr std::string_view part = layout_type::key(n.entry).substr(n.start, n.len);
+            if (key.size() - pos < n.len || std::char_traits<char>::compare(key.data() + pos, part.data(), n.len) != 0)
+                return layout_type::NOVALUE;
+            pos += n.len;
+            if (pos == key.size())
+                return n.value;
+            if constexpr (n.nedges == 0)
+                return layout_type::NOVALUE;
+            else
+                return findedge<N>(key[pos], key, pos + 1, std::make_index_sequence<n.nedges>());
+        }
+
+        template<size_t N, size_t... I>
+        static constexpr size_t findedge(char c, std::string_view key, size_t pos, std::index_sequence<I...>)
+        {
+            size_t r = layout_type::NOVALUE;
+            ((c == layout.edges[layout.nodes[N].firstedge + I].c
+                && (r = findnode<layout.edges[layout.nodes[N].firstedge + I].child>(key, pos), true)) || ...);
+            return r;
+        }
+    };
+}   // namespace tt_coreutils_ns
+#endif
@@ -2,8 +2,15 @@
 #define _STRING_TRIE_H_
 
 #include <utility>
+#include <atomic>
+#include <new>
+#include <queue>
+#include <vector>
+#include <string>
+#include <string.h>
 #include <assert.h>
 #include <iostream>
+#include <type_traits>
 
 /******************************************************************************************
  * stringtrie
@@ -42,10 +49,113 @@
  * stringtrie has the same interface as the stl::map<> but is not completely implemented, the
  * following still need to be completed:
  *   const_iterators
- *   upper_bound(), lower_bound
- *   equal_range
  *   insert with hint
- *   rbegin(), rend(), reverse_iterators (maybe i'll do this)
+ *
+ * Unlike stl::map, dereferencing an iterator gives a read only value, (*it).second = v does
+ * not compile. Write through it.value() = v, or use operator[]. Reading must not copy the
+ * nodes a snapshot shares, only a write does, see Snapshots.
+ *
+ * Ordered navigation:
+ *
+ * Child nodes are stored in the table by character, so a depth first walk visits the keys in
+ * alphabetical order. lower_bound(), upper_bound(), equal_range(), predecessor() and successor()
+ * descend once along the key and resolve the neighbour from the first table slot where the key
+ * and the trie diverge, so they are O(k) rather than a scan with next().
+ * Iterators are bidirectional and rbegin()/rend() provide reverse iteration.
+ *
+ * Snapshots:
+ *
+ * snapshot() returns an immutable point in time view of the trie in O(1). The nodes are
+ * reference counted and shared with the snapshot. When the trie is changed afterwards,
+ * only the path from the root to the changed node is copied (path copying), so a snapshot
+ * costs nothing until it is written through and then only the nodes on the changed paths.
+ * A snapshot may be read and released on another thread while the trie is being changed.
+ * The parent pointers belong to the live trie, so snapshots do not use them.
+ * While a snapshot shares the nodes, a change to the trie may move the element an older
+ * iterator refers to, so iterators should be found again after insert(), erase() or a
+ * write through value(). value() moves its own iterator onto the copy of the node, but
+ * other iterators to the same element still refer to the snapshot's node.
+ *
+ * Set operations:
+ *
+ * merge() moves the entries of another trie into this one. set_union(), set_intersection()
+ * and set_difference() fill a result trie from two others. They walk both tries together
+ * over the table slots, so a subtree that only one side has is spliced in, copied whole
+ * or skipped without looking at its keys.
+ *
+ * Subtree counts:
+ *
+ * With SUBTREE_COUNTS set in the traits (see stringtrie_counted_traits) each node also keeps
+ * the number of values in its subtree, maintained by insert() and erase(). count_prefix(),
+ * rank(), nth() and nth_with_prefix() use the counts to page through keys without iterating.
+ *
+ * Key types:
+ *
+ * The key type comes from the traits, std::string by default. stringtrie_keyed_traits<Key>
+ * gives a trie on other keys through stringtrie_key_traits<Key>, which turns a key into the
+ * bytes the trie stores. Integers are stored big endian, so iteration and lower_bound()
+ * follow numeric order, std::basic_string<unsigned char> holds binary strings such as
+ * hashes and std::pair of fixed length keys holds tuples such as an address and a port.
+ * Binary keys use a table of 256 slots. Keys of a fixed length are never a prefix of
+ * another key, so find() on them only reads the byte where each node branches and
+ * compares the whole key once at the leaf.
+ *
+ *     stringtrie<Order *, stringtrie_keyed_traits<uint64_t> > orders;
+ *
+ * Top k:
+ *
+ * With SUBTREE_SCORES set in the traits (see stringtrie_scored_traits) each node also keeps
+ * the best score of the values in its subtree, where the traits give the score of a
+ * value. top_k(prefix, k) returns the k best keys that start with prefix with a best first
+ * search from the prefix node: the search always expands the node or value with the best
+ * score left, so subtrees that cannot hold one of the k best are never visited. insert(),
+ * erase() and writes through an iterator's value() do not recompute the scores, they mark
+ * the nodes above the change as stale, and top_k() recomputes only the stale nodes under its
+ * prefix. Reading through operator* leaves the scores alone.
+ *
+ * Scanning text:
+ *
+ * With SCAN_LINKS set in the traits (see stringtrie_scan_traits) the trie doubles as an
+ * Aho-Corasick automaton. scan() reports every key that occurs anywhere in a buffer in one
+ * pass over the text, however many keys there are. A node holds part of a key, so the
+ * automaton's states are the characters within each node's part, and each node keeps a
+ * failure link and an output link per character. The links are built by buildlinks(),
+ * breadth first over the states, which scan() calls when the trie has changed since the
+ * last build. The links cost 24 bytes per state on 64 bit platforms.
+ *
+ * Burst mode:
+ *
+ * Most nodes deep in the trie have one child or none, yet each has a table of RANGE
+ * pointers, 1 KB of the node's 1.1 KB. With BURST_LIMIT set in the traits (see
+ * stringtrie_burst_traits) a node keeps up to BURST_LIMIT children in a short list sorted
+ * by character, which is searched with a linear scan, and only when it gets one more
+ * does the list burst into a full table. The table is allocated on its own, so a node
+ * that has burst costs one more pointer to follow. A node does not go back to a list
+ * when children are erased. All access to the children goes through getchild(),
+ * setchild(), nextchild() and prevchild(), so the rest of the trie works the same in
+ * both modes.
+ *
+ * Normalized keys:
+ *
+ * With NORMALIZE set in the traits (see stringtrie_normalized_traits) keys are compared
+ * after case folding and with separator characters left out, as the traits' fold() and
+ * ignore() say. insert() stores the normalized key. find(), erase(), lower_bound(),
+ * erase_prefix() and the other lookups normalize the key they are given a character at
+ * a time as they descend, so a lookup does not build a normalized copy of its key.
+ * Iteration gives back the normalized keys. fold() must give a character that is not
+ * ignored and that fold() leaves alone. scan() matches the text exactly. NORMALIZE is for
+ * text keys only, a trie with binary or fixed length keys does not compile with it (see
+ * stringtrie_normalizable).
+ *
+ * Relayout:
+ *
+ * After a long run of inserts and erases the nodes are scattered over the heap. relayout()
+ * moves every node, in depth first order, into large blocks so that a node is followed in
+ * memory by its first child and its neighbours in key order, and frees the old nodes. A
+ * block is freed when the last node in it goes. relayout(maxnodes) does the same a few
+ * nodes at a time, so a latency sensitive thread can spread a pass over many calls. The
+ * trie may be changed, and snapshots taken, between the calls. Like a change made while a
+ * snapshot is held, relayout() moves the elements, so iterators should be found again.
  *   
  *   Because a radix trie, which this is based on, supports lookups using a key prefix, an 
  *   interface could be defined to support these kind of lookups.
@@ -84,18 +194,529 @@
 
 namespace tt_coreutils_ns
 {
-    template < typename T>
+    // Key adaptors. The trie keeps its keys as byte strings, the key traits turn a key into
+    // its bytes and back. The bytes must sort in the same order as the keys.
+    //   RANGE          The number of different bytes, 128 for 7 bit text, 256 for binary keys
+    //   FIXED_LENGTH   The number of bytes in every key, or 0 if the length varies
+    //   bytes          Holds the bytes of one key, data() and size()
+    //   decode()       The key from its bytes
+    //
+    // The default is for integers, stored big endian so that the byte order is the
+    // numeric order. Signed integers have the sign bit flipped so negatives come first.
+    template<typename Key>
+    struct stringtrie_key_traits
+    {
+        static_assert(std::is_integral<Key>::value, "stringtrie_key_traits needs a specialization for this key type");
+        typedef typename std::make_unsigned<Key>::type unsigned_type;
+        enum {
+            RANGE = 256
+            , FIXED_LENGTH = sizeof(Key)
+        };
+
+        class bytes
+        {
+        public:
+            explicit bytes(Key k)
+            {
+                unsigned_type u = (unsigned_type)k;
+                if (std::is_signed<Key>::value)
+                    u ^= (unsigned_type)1 << (sizeof(Key) * 8 - 1);
+                for (int i = sizeof(Key) - 1; i >= 0; --i)
+                {
+                    buf[i] = (char)(u & 0xff);
+                    u = (unsigned_type)(u >> 8);
+                }
+            }
+            const char *data() const { return buf; }
+            size_t size() const { return sizeof(Key); }
+        private:
+            char buf[sizeof(Key)];
+        };
+
+        static Key decode(const char *p, size_t)
+        {
+            unsigned_type u = 0;
+            for (size_t i = 0; i < sizeof(Key); ++i)
+                u = (unsigned_type)((u << 8) | (unsigned char)p[i]);
+            if (std::is_signed<Key>::value)
+                u ^= (unsigned_type)1 << (sizeof(Key) * 8 - 1);
+            return (Key)u;
+        }
+    };
+
+    // Text, the bytes are the string itself
+    template<>
+    struct stringtrie_key_traits<std::string>
+    {
+        enum {
+            RANGE = 128
+            , FIXED_LENGTH = 0
+        };
+
+        class bytes
+        {
+        public:
+            explicit bytes(const std::string& k) : key(k) {}
+            const char *data() const { return key.data(); }
+            size_t size() const { return key.size(); }
+        private:
+            const std::string& key;
+        };
+
+        static std::string decode(const char *p, size_t len)
+        {
+            return std::string(p, len);
+        }
+    };
+
+    // Binary strings such as hashes, any byte value
+    template<>
+    struct stringtrie_key_traits<std::basic_string<unsigned char> >
+    {
+        typedef std::basic_string<unsigned char> key_type;
+        enum {
+            RANGE = 256
+            , FIXED_LENGTH = 0
+        };
+
+        class bytes
+        {
+        public:
+            explicit bytes(const key_type& k) : key(k) {}
+            const char *data() const { return (const char *)key.data(); }
+            size_t size() const { return key.size(); }
+        private:
+            const key_type& key;
+        };
+
+        static key_type decode(const char *p, size_t len)
+        {
+            return key_type((const unsigned char *)p, len);
+        }
+    };
+
+    // Tuples of fixed length keys, such as an address and a port. The bytes of first
+    // are followed by the bytes of second, so pairs sort by first and then second.
+    template<typename A, typename B>
+    struct stringtrie_key_traits<std::pair<A, B> >
+    {
+        typedef stringtrie_key_traits<A> first_traits;
+        typedef stringtrie_key_traits<B> second_traits;
+        static_assert(first_traits::FIXED_LENGTH != 0 && second_traits::FIXED_LENGTH != 0, "pair keys need fixed length members");
+        enum {
+            RANGE = 256
+            , FIXED_LENGTH = first_traits::FIXED_LENGTH + second_traits::FIXED_LENGTH
+        };
+
+        class bytes
+        {
+        public:
+            explicit bytes(const std::pair<A, B>& k)
+            {
+                typename first_traits::bytes a(k.first);
+                typename second_traits::bytes b(k.second);
+                memcpy(buf, a.data(), first_traits::FIXED_LENGTH);
+                memcpy(buf + first_traits::FIXED_LENGTH, b.data(), second_traits::FIXED_LENGTH);
+            }
+            const char *data() const { return buf; }
+            size_t size() const { return FIXED_LENGTH; }
+        private:
+            char buf[FIXED_LENGTH];
+        };
+
+        static std::pair<A, B> decode(const char *p, size_t)
+        {
+            return std::pair<A, B>(first_traits::decode(p, first_traits::FIXED_LENGTH)
+                , second_traits::decode(p + first_traits::FIXED_LENGTH, second_traits::FIXED_LENGTH));
+        }
+    };
+
+    // Compile time options. Derive from stringtrie_traits and override the enums
+    // to turn a feature on, the default trie pays nothing for features that are off.
+    struct stringtrie_traits
+    {
+        typedef std::string key_type;
+        typedef stringtrie_key_traits<std::string> key_traits;
+
+        enum {
+            SUBTREE_COUNTS = 0      // Each node keeps the number of values in its subtree
+            , SCAN_LINKS = 0        // Each node keeps the failure and output links used by scan()
+            , SUBTREE_SCORES = 0    // Each node keeps the best score in its subtree, needs score()
+            , BURST_LIMIT = 0       // Children kept in a short list before a node's table is allocated,
+                                    // 0 for a table in every node
+            , NORMALIZE = 0         // Keys are normalized with fold() and ignore()
+        };
+
+        // Key normalization, see Normalized keys above. A character of a key is left out
+        // if ignore() and otherwise stored, and compared, as fold()
+        static char fold(char c) { return c; }
+        static bool ignore(char) { return false; }
+    };
+
+    // Symbols that venues write in either case and with or without separators, so that
+    // "esz5", "ES Z5" and "ES-Z5" are all the key ESZ5
+    struct stringtrie_normalized_traits : public stringtrie_traits
+    {
+        enum {
+            NORMALIZE = 1
+        };
+
+        static char fold(char c)
+        {
+            return (unsigned char)(c - 'a') < 26 ? (char)(c - 'a' + 'A') : c;
+        }
+
+        // ' ', '-', '.', '/' and '_', with one test of a bit mask for the first four
+        static bool ignore(char c)
+        {
+            return (unsigned char)c < 64 ? ((1ULL << c) & ((1ULL << ' ') | (1ULL << '-') | (1ULL << '.') | (1ULL << '/'))) != 0 : c == '_';
+        }
+    };
+
+    struct stringtrie_counted_traits : public stringtrie_traits
+    {
+        enum {
+            SUBTREE_COUNTS = 1
+        };
+    };
+
+    // The number of values in a node's subtree, empty unless SUBTREE_COUNTS is on
+    template<bool bCounted>
+    class stringtrie_subtree
+    {
+    public:
+        size_t getsubtreecount() const { return 0; }
+    protected:
+        stringtrie_subtree() {}
+        void addsubtreecount(ptrdiff_t) {}
+    };
+
+    template<>
+    class stringtrie_subtree<true>
+    {
+    public:
+        size_t getsubtreecount() const { return nsubtree; }
+    protected:
+        stringtrie_subtree() : nsubtree(0) {}
+        void addsubtreecount(ptrdiff_t n) { nsubtree += n; }
+        size_t nsubtree;
+    };
+
+    // Scores for top_k(). The score of a value is score(value), compared with operator<.
+    // The default scores a value by itself, for a trie of volumes or counts; derive and
+    // hide score() to rank other values, such as a member of a struct:
+    //     static uint64_t score(const Symbol *p) { return p->volume; }
+    struct stringtrie_scored_traits : public stringtrie_traits
+    {
+        enum {
+            SUBTREE_SCORES = 1
+        };
+
+        template<typename V>
+        static const V& score(const V& v)
+        {
+            return v;
+        }
+    };
+
+    // The best score in a node's subtree, empty unless SUBTREE_SCORES is on. A stale score
+    // is recomputed by top_k(), and the parents of a stale node are always stale too.
+    template<bool bScored, typename T, typename Traits>
+    class stringtrie_scores
+    {
+    protected:
+        stringtrie_scores() {}
+        bool isscorestale() const { return true; }
+        void stalescore() {}
+        void copyscore(const stringtrie_scores&) {}
+    };
+
+    template<typename T, typename Traits>
+    class stringtrie_scores<true, T, Traits>
+    {
+    public:
+        typedef typename std::decay<decltype(Traits::score(std::declval<const T&>()))>::type score_type;
+        const score_type& getsubtreescore() const { return bestscore; }
+    protected:
+        stringtrie_scores() : bestscore(), bStale(false) {}
+        bool isscorestale() const { return bStale; }
+        void stalescore() { bStale = true; }
+        void copyscore(const stringtrie_scores& rhs) { bestscore = rhs.bestscore; bStale = rhs.bStale; }
+        score_type bestscore;
+        bool bStale;
+    };
+
+    struct stringtrie_scan_traits : public stringtrie_traits
+    {
+        enum {
+            SCAN_LINKS = 1
+        };
+    };
+
+    // A trie keyed on Key rather than std::string, the other options come from Base
+    template<typename Key, typename Base = stringtrie_traits>
+    struct stringtrie_keyed_traits : public Base
+    {
+        typedef Key key_type;
+        typedef stringtrie_key_traits<Key> key_traits;
+    };
+
+    // Whether the keys of a trie with these traits can be normalized. fold() and ignore()
+    // are for text, on binary or fixed length keys they would merge and drop key bytes,
+    // and the fixed length find() compares the bytes as they are.
+    template<typename Traits>
+    struct stringtrie_normalizable
+    {
+        enum {
+            value = Traits::NORMALIZE == 0 || (Traits::key_traits::RANGE == 128 && Traits::key_traits::FIXED_LENGTH == 0)
+        };
+    };
+
+    // The links of one scan() state
+    template<typename Node>
+    struct stringtrie_link
+    {
+        Node *pFail;                // The state of the longest proper suffix that is in the trie,
+        unsigned int faildepth;     // the first faildepth characters of pFail's key
+        Node *pOutput;              // The nearest node on the failure chain that ends a key, or NULL
+    };
+
+    // The failure and output links of a node's states for scan(), empty unless SCAN_LINKS is on
+    template<bool bLinked, typename Node>
+    class stringtrie_links
+    {
+    protected:
+        stringtrie_links() {}
+    };
+
+    template<typename Node>
+    class stringtrie_links<true, Node>
+    {
+    protected:
+        stringtrie_links() {}
+        std::vector<stringtrie_link<Node> > links;   // One for each character of the node's part of the key
+    };
+
+    // Nodes keep up to BURST_LIMIT children in a sorted list and burst into a full table
+    // when they get more, see Burst mode above
+    struct stringtrie_burst_traits : public stringtrie_traits
+    {
+        enum {
+            BURST_LIMIT = 8
+        };
+    };
+
+    // The children of a node, by the character that follows the node's part of the key.
+    //   get(i)     The child at i, or NULL
+    //   set(i, p)  Put p at i, a NULL p removes the child
+    //   next(i)    The first index at or after i that has a child, or Range
+    //   prev(i)    The last index at or before i that has a child, or -1
+    //
+    // With a Limit the children are kept in a list sorted by character, searched with a
+    // linear scan, until there are more than Limit of them. The list then bursts into a
+    // table of Range pointers, which is allocated on its own and kept until the node goes.
+    template<typename Node, int Range, int Limit>
+    class stringtrie_table
+    {
+    public:
+        stringtrie_table() : pSlots(NULL), count(0) {}
+        ~stringtrie_table() { delete [] pSlots; }
+
+        Node *get(int i) const
+        {
+            if (pSlots)
+                return pSlots[i];
+            for (int n = 0; n < count; ++n)
+            {
+                if (chars[n] == i)
+                    return children[n];
+            }
+            return NULL;
+        }
+
+        void set(int i, Node *p)
+        {
+            if (pSlots)
+            {
+                pSlots[i] = p;
+                return;
+            }
+            int n = 0;
+            while (n < count && chars[n] < i)
+                ++n;
+            if (n < count && chars[n] == i)
+            {
+                if (p)
+                {
+                    children[n] = p;
+                    return;
+                }
+                --count;
+                memmove(chars + n, chars + n + 1, count - n);
+                memmove(children + n, children + n + 1, (count - n) * sizeof(Node *));
+                return;
+            }
+            if (NULL == p)
+                return;
+            if (count == Limit)
+            {
+                pSlots = new Node *[Range]();
+                for (int j = 0; j < count; ++j)
+                    pSlots[chars[j]] = children[j];
+                pSlots[i] = p;
+                return;
+            }
+            memmove(chars + n + 1, chars + n, count - n);
+            memmove(children + n + 1, children + n, (count - n) * sizeof(Node *));
+            chars[n] = (unsigned char)i;
+            children[n] = p;
+            ++count;
+        }
+
+        int next(int i) const
+        {
+            if (pSlots)
+            {
+                while (i < Range && NULL == pSlots[i])
+                    ++i;
+                return i;
+            }
+            for (int n = 0; n < count; ++n)
+            {
+                if (chars[n] >= i)
+                    return chars[n];
+            }
+            return Range;
+        }
+
+        int prev(int i) const
+        {
+            if (pSlots)
+            {
+                while (i >= 0 && NULL == pSlots[i])
+                    --i;
+                return i;
+            }
+            for (int n = count - 1; n >= 0; --n)
+            {
+                if (chars[n] <= i)
+                    return chars[n];
+            }
+            return -1;
+        }
+
+        // Bytes allocated outside the node
+        size_t getmemusage() const { return pSlots ? Range * sizeof(Node *) : 0; }
+
+    private:
+        static_assert(Limit > 0 && Limit < Range && Limit < 256, "BURST_LIMIT must be less than RANGE");
+        stringtrie_table(const stringtrie_table&);
+        Node **pSlots;                  // The burst table, or NULL while the list holds the children
+        Node *children[Limit];
+        unsigned char chars[Limit];
+        unsigned char count;
+    };
+
+    // Without a Limit every node has the whole table
+    template<typename Node, int Range>
+    class stringtrie_table<Node, Range, 0>
+    {
+    public:
+        stringtrie_table() { memset(slots, 0, sizeof(slots)); }
+
+        Node *get(int i) const { return slots[i]; }
+        void set(int i, Node *p) { slots[i] = p; }
+
+        int next(int i) const
+        {
+            while (i < Range && NULL == slots[i])
+                ++i;
+            return i;
+        }
+
+        int prev(int i) const
+        {
+            while (i >= 0 && NULL == slots[i])
+                --i;
+            return i;
+        }
+
+        size_t getmemusage() const { return 0; }
+
+    private:
+        Node *slots[Range];
+    };
+
+    // A block of nodes laid out together by stringtrie::relayout(). The block holds a
+    // reference for each node placed in it and one for the trie while it is filling
+    // it, and is freed when the last one is released.
+    template<typename Node>
+    class stringtrie_arena
+    {
+    public:
+        explicit stringtrie_arena(size_t n)
+            : mem((char *)::operator new(n * sizeof(Node)))
+            , capacity(n)
+            , used(0)
+            , refs(1)
+        {
+        }
+
+        bool full() const { return used == capacity; }
+
+        void *allocate()
+        {
+            ++refs;
+            return mem + sizeof(Node) * used++;
+        }
+
+        void release()
+        {
+            if (--refs == 0)
+                delete this;
+        }
+
+    private:
+        ~stringtrie_arena() { ::operator delete(mem); }
+        char *mem;
+        size_t capacity;                // Nodes
+        size_t used;
+        std::atomic<size_t> refs;       // Nodes may be released by a snapshot on another thread
+    };
+
+    // Generations are unique across all tries, so a node moved from one trie to
+    // another by merge() is never taken to be private to its new trie
+    inline unsigned int stringtrie_newgen()
+    {
+        static std::atomic<unsigned int> lastgen(0);
+        return ++lastgen;
+    }
+
+    // The default value combiner for merge() and the set operations, keeps the first value
+    struct stringtrie_keepfirst
+    {
+        template<typename V>
+        const V& operator()(const V& first, const V&) const
+        {
+            return first;
+        }
+    };
+
+    template<typename T, typename Traits = stringtrie_traits>
     class stringtrie;
 
-    template <typename T> 
-    class stringtrie_node
+    template<typename T, typename Traits> 
+    class stringtrie_node : public stringtrie_subtree<Traits::SUBTREE_COUNTS != 0>
+        , public stringtrie_links<Traits::SCAN_LINKS != 0, stringtrie_node<T, Traits> >
+        , public stringtrie_scores<Traits::SUBTREE_SCORES != 0, T, Traits>
     {
     public:
         typedef T value_type;
         typedef std::string key_type;
-        typedef stringtrie_node<T> node_type;
+        typedef stringtrie_node<T, Traits> node_type;
         enum {
-            RANGE = 128
+            RANGE = Traits::key_traits::RANGE
+            , RANGE_MASK = RANGE - 1
         };    
 
         stringtrie_node();
@@ -107,39 +728,67 @@ namespace tt_coreutils_ns
 
         const value_type& getvalue() const {return value;}
         value_type& getvalue() {return value;}
+
+        // Drop a reference, the node and its unshared children are deleted with the last one
+        static void release(node_type *pNode);
         
     private:
         node_type *parent;
-        node_type *table[RANGE];
-        value_type value;
-        bool bInUse;
         std::string nodeKey;             // The full key of this node, a concatenation of all nodes from the root to here
         unsigned int posNodeKeyStart;    // The key of this node starts at this position. This is an index into nodeKey
-        friend class stringtrie<T>;
+        stringtrie_table<node_type, RANGE, Traits::BURST_LIMIT> table;    // The children, see getchild()
+        value_type value;
+        bool bInUse;
+        std::atomic<int> refcount;       // The number of parents and snapshots that refer to this node
+        unsigned int gen;                // The trie generation that last owned this node, see stringtrie::own()
+        stringtrie_arena<node_type> *pArena;    // The block relayout() placed this node in, or NULL
+        friend class stringtrie<T, Traits>;
     private:
+        stringtrie_node(const stringtrie_node&);
         void addchild(node_type *);
+        node_type *getchild(int i) const { return table.get(i); }
+        void setchild(int i, node_type *pChild) { table.set(i, pChild); }
+        // The index of the first child at or after i, or RANGE
+        int nextchild(int i) const { return table.next(i); }
+        // The index of the last child at or before i, or -1
+        int prevchild(int i) const { return table.prev(i); }
         void setvalue(const value_type& v);
-        node_type *_find( const std::string& key, unsigned int pos );
-        node_type* _findpartial( const std::string& key, unsigned int pos );
+        node_type *_find( const char *key, unsigned int len, unsigned int pos );
+        node_type* _findpartial( const char *key, unsigned int len, unsigned int pos );
+        // The position of the first character at or after pos that the traits do not ignore
+        static unsigned int skip(const char *key, unsigned int pos, unsigned int len)
+        {
+            while (pos < len && Traits::ignore(key[pos]))
+                ++pos;
+            return pos;
+        }
+        // The table slot of character c, or RANGE if c is above the range of the keys, such
+        // as a byte above 0x7f in 7 bit text. RANGE sorts after every slot.
+        static int tableindex(char c)
+        {
+            return ((unsigned char)c & ~RANGE_MASK) == 0 ? (unsigned char)c : (int)RANGE;
+        }
         int gettableindex() const;
     };
 
-    template <typename T> 
+    template<typename T, typename Traits> 
     class stringtrie
     {
     public:
-        typedef std::pair<const std::string, T> value_type;
-        typedef std::string key_type;
+        typedef typename Traits::key_type key_type;
+        typedef typename Traits::key_traits key_traits;
+        typedef std::pair<const key_type, T> value_type;
         typedef T mapped_type;
         typedef T& reference;
         typedef size_t size_type;
         typedef ptrdiff_t difference_type;
-        typedef stringtrie_node<T> node_type;
+        typedef stringtrie_node<T, Traits> node_type;
 
         enum {
-            RANGE = 128
-			, RANGE_MASK = 0x7f
+            RANGE = node_type::RANGE
+			, RANGE_MASK = node_type::RANGE_MASK
         };
+        static_assert(stringtrie_normalizable<Traits>::value != 0, "NORMALIZE needs text keys, not binary or fixed length ones");
 
         class iterator
         {
@@ -150,7 +799,7 @@ namespace tt_coreutils_ns
             {
             }
 
-            iterator(stringtrie<T> *pt, stringtrie_node<T> *pn)
+            iterator(stringtrie<T, Traits> *pt, stringtrie_node<T, Traits> *pn)
                 :pTrie(pt)
                  , pNode(pn)
             {
@@ -172,320 +821,1894 @@ namespace tt_coreutils_ns
                 return *this;
             }
             
-            std::pair<const std::string, reference> operator*()
+            // Reads never copy a node shared with a snapshot, use value() to change the value
+            std::pair<const key_type, const T&> operator*() const
+            {
+                return std::pair<const key_type, const T&>(decode(pNode), pNode->getvalue());
+            }
+
+            std::pair<const key_type, const T&> operator->() const
+            {
+                return std::pair<const key_type, const T&>(decode(pNode), pNode->getvalue());
+            }
+
+            // The value for writing. The node is copied first if a snapshot shares it,
+            // after which this iterator refers to the copy and no longer equals other
+            // iterators to the element, see Snapshots.
+            reference value()
             {
-                return std::pair<const std::string, reference>(pNode->getkey(), pNode->getvalue());
+                pNode = pTrie->ownvalue(pNode);
+                return pNode->getvalue();
             }
 
-            std::pair<const std::string, reference> operator->()
+            iterator operator++()
+            {
+                if (pNode == NULL || pTrie == NULL)
+                    return *this;
+                pNode = pTrie->next(pNode);
+                while (pNode && pNode->hasValue() == false)
+                    pNode = pTrie->next(pNode);
+                return *this;
+            }
+
+            iterator operator++(int)
+            {            
+                if (pNode == NULL || pTrie == NULL)
+                    return *this;
+                iterator r = *this;
+                pNode = pTrie->next(pNode);
+                while (pNode && pNode->hasValue() == false)
+                    pNode = pTrie->next(pNode);
+                return r;
+            }
+
+            // Decrementing end() gives the last element
+            iterator operator--()
+            {
+                if (pTrie == NULL)
+                    return *this;
+                pNode = pTrie->prevvalue(pNode);
+                return *this;
+            }
+
+            iterator operator--(int)
+            {
+                if (pTrie == NULL)
+                    return *this;
+                iterator r = *this;
+                pNode = pTrie->prevvalue(pNode);
+                return r;
+            }
+
+            bool operator==(const iterator& rhs) const
+            {
+                if (pNode == rhs.pNode)
+                    return true;
+                return false;
+            }
+            
+            bool operator!=(const iterator& rhs) const
+            {
+                if (pNode != rhs.pNode)
+                    return true;
+                return false;
+            }
+
+        private:
+            friend class stringtrie<T, Traits>;
+            stringtrie<T, Traits> *pTrie;
+            stringtrie_node<T, Traits> *pNode;
+        };
+
+        class reverse_iterator
+        {
+        public:
+            reverse_iterator()
+                :pTrie(NULL)
+                 , pNode(NULL)
+            {
+            }
+
+            reverse_iterator(stringtrie<T, Traits> *pt, stringtrie_node<T, Traits> *pn)
+                :pTrie(pt)
+                 , pNode(pn)
+            {
+
+            }
+
+            // Reads never copy a node shared with a snapshot, use value() to change the value
+            std::pair<const key_type, const T&> operator*() const
+            {
+                return std::pair<const key_type, const T&>(decode(pNode), pNode->getvalue());
+            }
+
+            std::pair<const key_type, const T&> operator->() const
+            {
+                return std::pair<const key_type, const T&>(decode(pNode), pNode->getvalue());
+            }
+
+            // The value for writing. The node is copied first if a snapshot shares it,
+            // after which this iterator refers to the copy and no longer equals other
+            // iterators to the element, see Snapshots.
+            reference value()
+            {
+                pNode = pTrie->ownvalue(pNode);
+                return pNode->getvalue();
+            }
+
+            reverse_iterator operator++()
+            {
+                if (pNode == NULL || pTrie == NULL)
+                    return *this;
+                pNode = pTrie->prevvalue(pNode);
+                return *this;
+            }
+
+            reverse_iterator operator++(int)
+            {
+                if (pNode == NULL || pTrie == NULL)
+                    return *this;
+                reverse_iterator r = *this;
+                pNode = pTrie->prevvalue(pNode);
+                return r;
+            }
+
+            bool operator==(const reverse_iterator& rhs) const
+            {
+                return pNode == rhs.pNode;
+            }
+
+            bool operator!=(const reverse_iterator& rhs) const
+            {
+                return pNode != rhs.pNode;
+            }
+
+            // The forward iterator one past this element in forward order, as for
+            // std::reverse_iterator, so rbegin().base() is end() and rend().base() is begin()
+            iterator base() const
+            {
+                if (pTrie == NULL)
+                    return iterator();
+                if (pNode == NULL)
+                    return pTrie->begin();
+                return iterator(pTrie, pTrie->firstvalue(pTrie->next(pNode)));
+            }
+
+        private:
+            friend class stringtrie<T, Traits>;
+            stringtrie<T, Traits> *pTrie;
+            stringtrie_node<T, Traits> *pNode;
+        };
+
+        // An immutable view of the trie at the time snapshot() was called. Copying
+        // a snapshot is O(1), the nodes are released when the last copy goes away.
+        class snapshot_type
+        {
+        public:
+            class const_iterator
+            {
+            public:
+                const_iterator()
+                {
+                }
+
+                std::pair<const key_type, const T&> operator*() const
+                {
+                    const node_type *pNode = path.back();
+                    return std::pair<const key_type, const T&>(decode(pNode), pNode->getvalue());
+                }
+
+                const_iterator operator++()
+                {
+                    next();
+                    while (path.empty() == false && path.back()->hasValue() == false)
+                        next();
+                    return *this;
+                }
+
+                bool operator==(const const_iterator& rhs) const
+                {
+                    return path == rhs.path;
+                }
+
+                bool operator!=(const const_iterator& rhs) const
+                {
+                    return path != rhs.path;
+                }
+
+            private:
+                friend class snapshot_type;
+
+                // Depth first, the same order as stringtrie::next() but walking
+                // back up the path rather than the parent pointers
+                void next()
+                {
+                    int tblidx = 0;
+                    while (path.empty() == false)
+                    {
+                        const node_type *pn = path.back();
+                        tblidx = pn->nextchild(tblidx);
+                        if (tblidx < RANGE)
+                        {
+                            path.push_back(pn->getchild(tblidx));
+                            return;
+                        }
+                        tblidx = pn->gettableindex() + 1;
+                        path.pop_back();
+                    }
+                }
+
+                std::vector<const node_type *> path;    // From the root of the snapshot
+            };
+
+            snapshot_type()
+                :root(NULL)
+                , nsize(0)
+            {
+            }
+
+            snapshot_type(const snapshot_type& rhs)
+                :root(rhs.root)
+                , nsize(rhs.nsize)
+            {
+                if (root)
+                    ++root->refcount;
+            }
+
+            snapshot_type& operator=(const snapshot_type& rhs)
+            {
+                if (rhs.root)
+                    ++rhs.root->refcount;
+                if (root)
+                    node_type::release(root);
+                root = rhs.root;
+                nsize = rhs.nsize;
+                return *this;
+            }
+
+            ~snapshot_type()
+            {
+                if (root)
+                    node_type::release(root);
+            }
+
+            size_t size() const
+            {
+                return nsize;
+            }
+
+            bool empty() const
+            {
+                return nsize == 0;
+            }
+
+            // Returns the value of key, or NULL if it is not in the snapshot
+            const T *find(const key_type& key) const
+            {
+                if (NULL == root)
+                    return NULL;
+                typename key_traits::bytes b(key);
+                node_type *pNode = root->_find(b.data(), b.size(), 0);
+                if (pNode == NULL || pNode->hasValue() == false)
+                    return NULL;
+                return &pNode->getvalue();
+            }
+
+            size_type count(const key_type& key) const
+            {
+                return find(key) ? 1 : 0;
+            }
+
+            const_iterator begin() const
+            {
+                const_iterator it;
+                if (root)
+                {
+                    it.path.push_back(root);
+                    ++it;
+                }
+                return it;
+            }
+
+            const_iterator end() const
+            {
+                return const_iterator();
+            }
+
+        private:
+            friend class stringtrie<T, Traits>;
+            snapshot_type(node_type *pRoot, size_t n)
+                :root(pRoot)
+                , nsize(n)
+            {
+                ++root->refcount;
+            }
+
+            node_type *root;
+            size_t nsize;
+        };
+
+        stringtrie();
+        ~stringtrie();
+
+        // Copies every node, the copy does not share anything with this trie
+        stringtrie(const stringtrie<T, Traits>& cc);
+        stringtrie<T, Traits>& operator=(const stringtrie<T, Traits>& rhs);
+
+        // O(1), see Snapshots above
+        snapshot_type snapshot()
+        {
+            gen = stringtrie_newgen();
+            return snapshot_type(root, nsize);
+        }
+
+        // Moves every entry of other into this trie and leaves other empty. Where both
+        // have a key the value becomes combine(this value, other value). The two tries
+        // are walked together node by node, subtrees that are only in other are spliced
+        // in without being visited.
+        void merge(stringtrie<T, Traits>& other)
+        {
+            merge(other, stringtrie_keepfirst());
+        }
+
+        template<typename Combine>
+        void merge(stringtrie<T, Traits>& other, Combine combine);
+
+        // Set operations, result is replaced with the keys in a or b, in a and b, or in
+        // a and not in b. combine(a value, b value) gives the value of a key in both.
+        // Like merge() these walk both tries together; subtrees only in a or b are
+        // copied whole for a union or skipped by an intersection.
+        template<typename Combine>
+        friend void set_union(const stringtrie<T, Traits>& a, const stringtrie<T, Traits>& b, stringtrie<T, Traits>& result, Combine combine)
+        {
+            assert(&result != &b);
+            result = a;
+            result.root = result.own(result.root);
+            mergestats stats;
+            result._merge(result.root, b.root, 0, false, combine, stats);
+            result.nsize += b.nsize - stats.ncollisions;
+            result.numnodes += stats.nadded;
+        }
+
+        friend void set_union(const stringtrie<T, Traits>& a, const stringtrie<T, Traits>& b, stringtrie<T, Traits>& result)
+        {
+            set_union(a, b, result, stringtrie_keepfirst());
+        }
+
+        template<typename Combine>
+        friend void set_intersection(const stringtrie<T, Traits>& a, const stringtrie<T, Traits>& b, stringtrie<T, Traits>& result, Combine combine)
+        {
+            assert(&result != &a && &result != &b);
+            intersection<Combine> fn(result, combine);
+            result.clear();
+            _join(a.root, b.root, 0, fn);
+        }
+
+        friend void set_intersection(const stringtrie<T, Traits>& a, const stringtrie<T, Traits>& b, stringtrie<T, Traits>& result)
+        {
+            set_intersection(a, b, result, stringtrie_keepfirst());
+        }
+
+        friend void set_difference(const stringtrie<T, Traits>& a, const stringtrie<T, Traits>& b, stringtrie<T, Traits>& result)
+        {
+            assert(&result != &a && &result != &b);
+            mergestats stats;
+            node_type::release(result.root);
+            result.root = result._subtract(a.root, b.root, 0, NULL, stats);
+            result.numnodes = stats.nadded - 1;
+            if (NULL == result.root)
+            {
+                result.root = result.newnode();
+                result.numnodes = 0;
+            }
+            result.nsize = a.nsize - stats.ncollisions;
+        }
+
+        std::pair<iterator, bool> insert(const value_type&);
+
+        // Insert and find with a key that is not in a std::string, such as a field in 
+        // a buffer. The key is copied only into the nodes that are created.
+        std::pair<iterator, bool> insert(const char *key, size_t len, const T& value);
+        iterator find(const char *key, size_t len);
+
+        // Whether every character of the key has a slot in the tables. insert() returns
+        // false for a key that does not, such as text with bytes above 0x7f, and find()
+        // does not find it.
+        static bool validkey(const char *key, size_t len)
+        {
+            for (size_t i = 0; i < len; ++i)
+            {
+                if (node_type::tableindex(Traits::fold(key[i])) == RANGE)
+                    return false;
+            }
+            return true;
+        }
+        void erase ( iterator position );
+        size_type erase ( const key_type& k );
+
+        // Erase every key in [first, last), or every key that starts with prefix. Whole
+        // subtrees are unlinked with one descent and freed together, rather than
+        // erased key by key. erase_prefix() returns the number of keys erased.
+        void erase ( iterator first, iterator last );
+        size_type erase_prefix ( const key_type& prefix );
+        size_type count ( const key_type& k ) const
+        {
+            typename key_traits::bytes b(k);
+            node_type *pNode = root->_find(b.data(), b.size(), 0);
+            if (pNode && pNode->hasValue())
+                return 1;
+            return 0;
+        }
+
+        bool empty() const
+        {
+            return nsize == 0;
+        }
+
+        void clear()
+        {
+            node_type::release(root);
+            root = newnode();
+            numnodes = 0;
+            nsize = 0;
+        }
+
+        iterator find(const key_type& key);
+
+        inline T& operator[](const key_type& k)
+        {
+            iterator i = find( k );
+           
+            if( i==end() )
+            {
+                std::pair<stringtrie<T, Traits>::iterator, bool> p = insert( value_type(k, T()) );
+                stringtrie<T, Traits>::iterator it = find(k);
+                return it.value();
+            }
+            return i.value();
+        }
+
+        size_t size() const
+        {
+            return nsize;
+        }
+
+        iterator begin()
+        {
+            return iterator(this, firstvalue(next(root)));
+        }
+
+        iterator end()
+        {
+            return iterator(this, NULL);
+        }
+
+        reverse_iterator rbegin()
+        {
+            return reverse_iterator(this, prevvalue(NULL));
+        }
+
+        reverse_iterator rend()
+        {
+            return reverse_iterator(this, NULL);
+        }
+
+        // The first element whose key is not less than k
+        iterator lower_bound(const key_type& k)
+        {
+            typename key_traits::bytes b(k);
+            return iterator(this, _bound(b.data(), b.size(), false));
+        }
+
+        // The first element whose key is greater than k
+        iterator upper_bound(const key_type& k)
+        {
+            typename key_traits::bytes b(k);
+            return iterator(this, _bound(b.data(), b.size(), true));
+        }
+
+        std::pair<iterator, iterator> equal_range(const key_type& k)
+        {
+            return std::pair<iterator, iterator>(lower_bound(k), upper_bound(k));
+        }
+
+        // The last element whose key is less than k, or end()
+        iterator predecessor(const key_type& k)
+        {
+            typename key_traits::bytes b(k);
+            return iterator(this, prevvalue(_bound(b.data(), b.size(), false)));
+        }
+
+        // The first element whose key is greater than k, or end()
+        iterator successor(const key_type& k)
+        {
+            return upper_bound(k);
+        }
+
+        int getmemusage() const;
+        int getnumnodes() const;
+
+        // The following need SUBTREE_COUNTS in the traits. They use the subtree counts 
+        // kept in each node, so they are O(k*RANGE) and do not walk the entries.
+
+        // The number of keys that start with prefix
+        size_type count_prefix(const key_type& prefix);
+
+        // The number of keys less than k
+        size_type rank(const key_type& k);
+
+        // The n'th key in order, counting from 0, or end()
+        iterator nth(size_type n);
+
+        // The n'th key, in order, of the keys that start with prefix, or end()
+        iterator nth_with_prefix(const key_type& prefix, size_type n);
+
+        // The following needs SUBTREE_SCORES in the traits, see Top k above.
+
+        // The k keys that start with prefix with the best scores, best first. Keys with
+        // the same score come in no particular order.
+        std::vector<iterator> top_k(const key_type& prefix, size_type k);
+
+        // The following need SCAN_LINKS in the traits, see Scanning text above.
+
+        // Calls callback(offset, len, value) for every key that occurs in text, in the
+        // order the matches end, and returns the number of matches. The links are
+        // built first if the trie has changed since they were last built.
+        template<typename Fn>
+        size_t scan(const char *text, size_t len, Fn callback);
+
+        template<typename Fn>
+        size_t scan(const std::string& text, Fn callback)
+        {
+            return scan(text.data(), text.size(), callback);
+        }
+
+        // Build the failure and output links now rather than in the next scan()
+        void buildlinks();
+
+        // Move every node into contiguous blocks in depth first order, see Relayout above
+        void relayout()
+        {
+            while (relayout(~(size_t)0) == false)
+                ;
+        }
+
+        // Move at most maxnodes nodes, carrying on from where the last call stopped.
+        // Returns true when a pass over the whole trie is complete.
+        bool relayout(size_t maxnodes);
+
+    private:
+        node_type *root;
+        int numnodes;
+        size_t nsize;
+        unsigned int gen;   // Bumped by snapshot(), nodes stamped with the current gen are not shared
+        bool bLinks;        // The scan() links are up to date, cleared by any change to the trie
+        stringtrie_arena<node_type> *pArena;    // The block relayout() is filling, NULL between passes
+        std::string relayoutkey;                // The key of the next node relayout() moves
+    private:
+        unsigned int substrlength(const std::string& s1, const char *s2, unsigned int len2);
+        node_type *_bound(const char *key, size_t len, bool bUpper);
+        node_type *_boundnode(const char *key, size_t len, bool bUpper);
+        node_type *_findprefix(const key_type& prefix);
+        node_type *_findfixed(const char *key);
+        // find() of a key's bytes, by whether the keys have a fixed length, so _findfixed()
+        // is only compiled for the tries that use it
+        iterator _findkey(const char *key, size_t len, std::integral_constant<bool, false>);
+        iterator _findkey(const char *key, size_t len, std::integral_constant<bool, true>);
+        size_type _erase(const char *key, size_t len);
+        std::pair<iterator, bool> _insert(const char *key, size_t len, const T& value);
+
+        static key_type decode(const node_type *pNode)
+        {
+            return key_traits::decode(pNode->nodeKey.data(), pNode->nodeKey.size());
+        }
+        node_type *_nth(node_type *pNode, size_type n);
+        void _rescore(node_type *pNode);
+        node_type *_own(node_type *pNode);
+        node_type *clone(const node_type *pNode, node_type *pParent, int *pNodes = NULL);
+        node_type *copynode(const node_type *pNode, bool bArena = false);
+        node_type *replace(node_type *pNode, bool bArena);
+        void prune(node_type *pNode);
+        void detach(node_type *pNode);
+        void discard(node_type *pNode);
+        void countnodes(const node_type *pNode);
+        size_t tablememusage(const node_type *pNode) const;
+
+        // Set operation helpers
+        struct mergestats
+        {
+            mergestats() : ncollisions(0), ndropped(0), nadded(0) {}
+            size_t ncollisions;     // Keys in both tries
+            int ndropped;           // Nodes of the other trie that were merged into ours
+            int nadded;             // Nodes we created or copied
+        };
+
+        template<typename Combine>
+        void _merge(node_type *a, node_type *b, unsigned int pos, bool bMove, Combine& combine, mergestats& stats);
+        void attach(node_type *pParent, node_type *b, unsigned int pos, bool bMove, mergestats& stats);
+        node_type *_subtract(const node_type *a, const node_type *b, unsigned int pos, node_type *pParent, mergestats& stats);
+        template<typename Fn>
+        static void _join(node_type *a, node_type *b, unsigned int pos, Fn& fn);
+
+        template<typename Combine>
+        struct intersection
+        {
+            intersection(stringtrie<T, Traits>& r, Combine& c) : result(r), combine(c) {}
+            void operator()(node_type *a, node_type *b)
+            {
+                if (a->hasValue() && b->hasValue())
+                    result.insert(a->getkey().data(), a->getkey().size(), combine(a->getvalue(), b->getvalue()));
+            }
+            stringtrie<T, Traits>& result;
+            Combine& combine;
+        };
+
+
+        // Set the subtree count of pNode from its value and its children, and mark its
+        // best score stale
+        void recount(node_type *pNode)
+        {
+            pNode->stalescore();
+            if (Traits::SUBTREE_COUNTS)
+            {
+                ptrdiff_t n = pNode->hasValue() ? 1 : 0;
+                for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
+                    n += pNode->getchild(i)->getsubtreecount();
+                pNode->addsubtreecount(n - (ptrdiff_t)pNode->getsubtreecount());
+            }
+        }
+
+        node_type *newnode(bool bArena = false)
+        {
+            node_type *pNode;
+            if (bArena)
+            {
+                // The trie grew while relayout() was part way through
+                if (pArena->full())
+                {
+                    pArena->release();
+                    pArena = new stringtrie_arena<node_type>(numnodes / 8 + 64);
+                }
+                pNode = new (pArena->allocate()) node_type();
+                pNode->pArena = pArena;
+            }
+            else
+            {
+                pNode = new node_type();
+            }
+            pNode->gen = gen;
+            bLinks = false;
+            return pNode;
+        }
+
+        // scan() states. A state is the first depth characters of pNode's key, where
+        // depth is within pNode's part of the key, or the root with a depth of 0.
+
+        // Move to the state one character c further on, false if the trie has no such state
+        static bool advance(node_type *&pNode, unsigned int& depth, char c)
+        {
+            if (depth < pNode->nodeKey.size())
+            {
+                if (pNode->nodeKey[depth] != c)
+                    return false;
+            }
+            else
+            {
+                node_type *pChild = pNode->getchild(c & RANGE_MASK);
+                if (NULL == pChild || pChild->nodeKey[depth] != c)
+                    return false;
+                pNode = pChild;
+            }
+            ++depth;
+            return true;
+        }
+
+        static stringtrie_link<node_type>& getlink(node_type *pNode, unsigned int depth)
+        {
+            return pNode->links[depth - pNode->posNodeKeyStart - 1];
+        }
+
+        // Returns a version of pNode that is not shared with a snapshot and is safe to
+        // change, copying it and its parents if they are shared
+        node_type *own(node_type *pNode)
+        {
+            if (pNode->gen == gen)
+                return pNode;
+            return _own(pNode);
+        }
+
+        // Add n to the subtree count of pNode and all its parents. The values under them
+        // have changed, so their best scores are stale too.
+        void addcount(node_type *pNode, ptrdiff_t n)
+        {
+            markscore(pNode);
+            if (Traits::SUBTREE_COUNTS)
+            {
+                for (; pNode; pNode = pNode->parent)
+                    pNode->addsubtreecount(n);
+            }
+        }
+
+        // Mark the best score of pNode and its parents stale, up to the first parent
+        // that already is
+        void markscore(node_type *pNode)
+        {
+            if (Traits::SUBTREE_SCORES)
+            {
+                for (; pNode && pNode->isscorestale() == false; pNode = pNode->parent)
+                    pNode->stalescore();
+            }
+        }
+
+        // own() for an iterator that hands out a writable reference to the value
+        node_type *ownvalue(node_type *pNode)
+        {
+            pNode = own(pNode);
+            markscore(pNode);
+            return pNode;
+        }
+
+        // Returns the next node in depth first order, starting the search of
+        // current's table at tblidx. Passing tblidx past the children of
+        // current skips its subtree.
+        node_type *next(node_type *current, int tblidx = 0)
+        {
+            node_type *pn = current;
+            while (pn)
+            {
+                // depth first
+                tblidx = pn->nextchild(tblidx);
+                if (tblidx < RANGE)
+                {
+                    return pn->getchild(tblidx);
+                }
+                if (NULL == pn->parent)
+                {
+                    return NULL;
+                }
+                // Get the index this node is in the parent
+                tblidx = pn->gettableindex();
+                ++tblidx;
+                pn = pn->parent;
+            }
+            return NULL;
+        }
+
+        // Returns the previous node in depth first order, NULL when we reach the root
+        node_type *prev(node_type *current)
+        {
+            node_type *pn = current->parent;
+            if (NULL == pn)
+            {
+                return NULL;
+            }
+            int tblidx = pn->prevchild(current->gettableindex() - 1);
+            if (tblidx >= 0)
+            {
+                return last(pn->getchild(tblidx));
+            }
+            if (NULL == pn->parent)
+            {
+                return NULL;
+            }
+            return pn;
+        }
+
+        // Returns the last node of the subtree in depth first order
+        node_type *last(node_type *pn)
+        {
+            int tblidx = pn->prevchild(RANGE - 1);
+            while (tblidx >= 0)
+            {
+                pn = pn->getchild(tblidx);
+                tblidx = pn->prevchild(RANGE - 1);
+            }
+            return pn;
+        }
+
+        // Returns pn, or the first node after it that has a value
+        node_type *firstvalue(node_type *pn)
+        {
+            if (pn == root)
+                pn = next(root);
+            while (pn && pn->hasValue() == false)
+                pn = next(pn);
+            return pn;
+        }
+
+        // Returns the last node before current that has a value. A NULL current
+        // is the end of the trie
+        node_type *prevvalue(node_type *current)
+        {
+            node_type *pn = (current == NULL) ? last(root) : prev(current);
+            if (pn == root)
+                return NULL;
+            while (pn && pn->hasValue() == false)
+                pn = prev(pn);
+            return pn;
+        }
+    };
+
+    //=================================================================
+    // stringtrie
+    //=================================================================
+    template<typename T, typename Traits>
+    inline stringtrie<T, Traits>::stringtrie()
+        : root(NULL)
+        , numnodes(0)
+        , nsize(0)
+        , gen(stringtrie_newgen())
+        , bLinks(false)
+        , pArena(NULL)
+    {
+        root = newnode();
+    }
+
+    template<typename T, typename Traits>
+    stringtrie<T, Traits>::stringtrie(const stringtrie<T, Traits>& cc)
+        : root(NULL)
+        , numnodes(cc.numnodes)
+        , nsize(cc.nsize)
+        , gen(stringtrie_newgen())
+        , bLinks(false)
+        , pArena(NULL)
+    {
+        root = clone(cc.root, NULL);
+    }
+
+    template<typename T, typename Traits>
+    stringtrie<T, Traits>& stringtrie<T, Traits>::operator=(const stringtrie<T, Traits>& rhs)
+    {
+        if (this == &rhs)
+            return *this;
+        node_type *pRoot = clone(rhs.root, NULL);
+        node_type::release(root);
+        root = pRoot;
+        numnodes = rhs.numnodes;
+        nsize = rhs.nsize;
+        return *this;
+    }
+
+    template<typename T, typename Traits>
+    stringtrie<T, Traits>::~stringtrie()
+    {
+        node_type::release(root);
+        if (pArena)
+            pArena->release();
+    }
+
+    // Deep copy of a subtree, pNodes is incremented for each node copied
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::clone(const node_type *pNode, node_type *pParent, int *pNodes)
+    {
+        if (pNodes)
+            ++*pNodes;
+        node_type *pCopy = newnode();
+        pCopy->parent = pParent;
+        pCopy->value = pNode->value;
+        pCopy->bInUse = pNode->bInUse;
+        pCopy->nodeKey = pNode->nodeKey;
+        pCopy->posNodeKeyStart = pNode->posNodeKeyStart;
+        pCopy->addsubtreecount(pNode->getsubtreecount());
+        pCopy->copyscore(*pNode);
+        for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
+            pCopy->setchild(i, clone(pNode->getchild(i), pCopy, pNodes));
+        return pCopy;
+    }
+
+    // Path copying. The parents are made private first, then if pNode is still referred
+    // to by a snapshot it is replaced in its parent with a copy. The copy shares the
+    // children, which now have one more reference, so they will be copied in turn if
+    // they are changed.
+    // Copy of a single node that shares the children of the original, the children's
+    // parent pointers move to the copy
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::copynode(const node_type *pNode, bool bArena)
+    {
+        node_type *pCopy = newnode(bArena);
+        pCopy->parent = pNode->parent;
+        pCopy->value = pNode->value;
+        pCopy->bInUse = pNode->bInUse;
+        pCopy->nodeKey = pNode->nodeKey;
+        pCopy->posNodeKeyStart = pNode->posNodeKeyStart;
+        pCopy->addsubtreecount(pNode->getsubtreecount());
+        pCopy->copyscore(*pNode);
+        for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
+        {
+            node_type *pChild = pNode->getchild(i);
+            ++pChild->refcount;
+            pChild->parent = pCopy;
+            pCopy->setchild(i, pChild);
+        }
+        return pCopy;
+    }
+
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::_own(node_type *pNode)
+    {
+        if (pNode->parent)
+            own(pNode->parent);
+        if (pNode->refcount == 1)
+        {
+            pNode->gen = gen;
+            return pNode;
+        }
+        return replace(pNode, false);
+    }
+
+    // Put a copy of pNode in its place in the parent, which must be private, or as the root
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::replace(node_type *pNode, bool bArena)
+    {
+        node_type *pCopy = copynode(pNode, bArena);
+        if (pCopy->parent)
+            pCopy->parent->addchild(pCopy);
+        else
+            root = pCopy;
+        node_type::release(pNode);
+        return pCopy;
+    }
+
+    // Each node is moved on its own, the same way own() copies a shared node, so the trie
+    // is complete after every node and may be changed between calls. The next node is
+    // found again from its key because a change may have moved or removed it.
+    template<typename T, typename Traits>
+    bool stringtrie<T, Traits>::relayout(size_t maxnodes)
+    {
+        node_type *pNode = root;
+        if (NULL == pArena)
+            pArena = new stringtrie_arena<node_type>(numnodes + 1);
+        else
+            pNode = _boundnode(relayoutkey.data(), relayoutkey.size(), false);
+
+        for (size_t n = 0; pNode && n < maxnodes; ++n)
+        {
+            if (pNode->parent)
+                own(pNode->parent);
+            pNode = next(replace(pNode, true));
+        }
+        if (pNode)
+        {
+            relayoutkey = pNode->nodeKey;
+            return false;
+        }
+        pArena->release();
+        pArena = NULL;
+        relayoutkey.clear();
+        return true;
+    }
+
+    // With BURST_LIMIT the tables of the nodes that burst are counted by walking the trie
+    template<typename T, typename Traits>
+    inline int stringtrie<T, Traits>::getmemusage( ) const
+    {
+        if (Traits::BURST_LIMIT != 0)
+            return (int)(this->numnodes * sizeof(node_type) + tablememusage(root));
+        return this->numnodes * sizeof(node_type);
+    }
+
+    template<typename T, typename Traits>
+    size_t stringtrie<T, Traits>::tablememusage(const node_type *pNode) const
+    {
+        size_t n = pNode->table.getmemusage();
+        for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
+            n += tablememusage(pNode->getchild(i));
+        return n;
+    }
+
+    template<typename T, typename Traits>
+    inline int stringtrie<T, Traits>::getnumnodes( ) const
+    {
+        return this->numnodes;
+    }
+
+    template<typename T, typename Traits>
+    inline typename stringtrie<T, Traits>::iterator stringtrie<T, Traits>::find( const key_type& key )
+    {
+        typename key_traits::bytes b(key);
+        return _findkey(b.data(), b.size(), std::integral_constant<bool, key_traits::FIXED_LENGTH != 0>());
+    }
+
+    template<typename T, typename Traits>
+    inline typename stringtrie<T, Traits>::iterator stringtrie<T, Traits>::_findkey( const char *key, size_t len, std::integral_constant<bool, false> )
+    {
+        return find(key, len);
+    }
+
+    template<typename T, typename Traits>
+    inline typename stringtrie<T, Traits>::iterator stringtrie<T, Traits>::_findkey( const char *key, size_t, std::integral_constant<bool, true> )
+    {
+        node_type *pNode = _findfixed(key);
+        if (pNode == NULL || pNode->hasValue() == false)
+            return end();
+        return iterator(this, pNode);
+    }
+
+    // Fixed length keys are never a prefix of one another, so every value is in a leaf
+    // FIXED_LENGTH bytes deep. The descent only reads the byte where each node branches
+    // and the leaf is checked with one compare of FIXED_LENGTH bytes, which the compiler
+    // turns into word compares.
+    template<typename T, typename Traits>
+    inline typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::_findfixed( const char *key )
+    {
+        enum { LENGTH = key_traits::FIXED_LENGTH };
+        node_type *pNode = root;
+        size_t depth = 0;
+        while (depth < LENGTH)
+        {
+            pNode = pNode->getchild(key[depth] & RANGE_MASK);
+            if (NULL == pNode)
+                return NULL;
+            depth = pNode->nodeKey.size();
+        }
+        if (depth != LENGTH || memcmp(pNode->nodeKey.data(), key, LENGTH) != 0)
+            return NULL;
+        return pNode;
+    }
+
+    template<typename T, typename Traits>
+    inline typename stringtrie<T, Traits>::iterator stringtrie<T, Traits>::find( const char *key, size_t len )
+    {
+        int pos = 0;
+        node_type *pNode = root->_find(key, len, pos);
+        if (pNode == NULL || pNode->hasValue() == false)
+            return end();
+        return iterator(this, pNode);
+    }
+
+    template<typename T, typename Traits>
+    inline std::pair<typename stringtrie<T, Traits>::iterator, bool> stringtrie<T, Traits>::insert(const value_type& v)
+    {
+        typename key_traits::bytes b(v.first);
+        return insert(b.data(), b.size(), v.second);
+    }
+
+    // The key is stored normalized, so it is normalized here once rather than as it is read
+    template<typename T, typename Traits>
+    std::pair<typename stringtrie<T, Traits>::iterator, bool> stringtrie<T, Traits>::insert(const char *key, size_t len, const T& value)
+    {
+        if (Traits::NORMALIZE)
+        {
+            std::string normal;
+            normal.reserve(len);
+            for (size_t i = 0; i < len; ++i)
+            {
+                if (Traits::ignore(key[i]) == false)
+                    normal += Traits::fold(key[i]);
+            }
+            return _insert(normal.data(), normal.size(), value);
+        }
+        return _insert(key, len, value);
+    }
+
+    template<typename T, typename Traits>
+    std::pair<typename stringtrie<T, Traits>::iterator, bool> stringtrie<T, Traits>::_insert(const char *key, size_t len, const T& value)
+    {
+        if (validkey(key, len) == false)
+            return std::pair<iterator, bool>(iterator(), false);
+        ++nsize;
+
+        // Find the deepest node that at least partially
+        // matches the key
+        node_type *pNode = root->_findpartial(key, len, 0);
+        bool bMatch = pNode->getkey().size() == len && memcmp(pNode->getkey().data(), key, len) == 0;
+
+        if (bMatch && pNode->bInUse)
+        {
+            --nsize;
+            return std::pair<iterator, bool>(iterator(), false);   // key exists;
+        }
+        pNode = own(pNode);
+        bLinks = false;
+
+        if (bMatch)
+        {
+            pNode->setvalue(value);
+            addcount(pNode, 1);
+            return std::pair<iterator, bool>(iterator(this, pNode), true);
+        }
+
+        unsigned int pos = substrlength(pNode->getkey(), key, len);
+        if (pos == pNode->getkey().length())
+        {
+            //The new key is a superset of this node's key, this will be easy...
+            node_type *pNewChildNode = newnode();
+            ++numnodes;
+            pNewChildNode->nodeKey.assign(key, len);
+            pNewChildNode->posNodeKeyStart = pos;
+            pNewChildNode->parent = pNode;
+            pNewChildNode->setvalue(value);
+            pNode->addchild(pNewChildNode);
+            addcount(pNewChildNode, 1);
+            return std::pair<iterator, bool>(iterator(this, pNewChildNode), true);
+        }
+        // We need to split this node
+        // Insert a new node 
+        node_type *orig_parent = pNode->parent;
+        node_type *pNewParentNode = newnode();
+        ++numnodes;
+        pNewParentNode->parent = pNode->parent;        
+        pNewParentNode->nodeKey = pNode->getkey().substr(0, pos);
+        pNewParentNode->posNodeKeyStart = pNode->posNodeKeyStart;
+        pNewParentNode->addsubtreecount(pNode->getsubtreecount());
+        orig_parent->addchild(pNewParentNode);       
+
+        pNode->parent = pNewParentNode;
+        pNode->posNodeKeyStart = pos;
+
+        pNewParentNode->addchild(pNode);
+
+        // The new key is a prefix of this node's key, so the new parent is the new key
+        if (pos == len)
+        {
+            pNewParentNode->setvalue(value);
+            addcount(pNewParentNode, 1);
+            return std::pair<iterator, bool>(iterator(this, pNewParentNode), true);
+        }
+
+        // Now add the new node
+        pNode = newnode();
+        ++numnodes;
+        pNode->parent = pNewParentNode;
+        pNode->setvalue(value);
+        pNode->nodeKey.assign(key, len);
+        pNode->posNodeKeyStart = pos;
+        pNewParentNode->addchild(pNode);
+        addcount(pNode, 1);
+        return std::pair<iterator, bool>(iterator(this, pNode), true);
+    }
+
+    template<typename T, typename Traits> 
+    void stringtrie<T, Traits>::erase(typename stringtrie<T, Traits>::iterator it)
+    {
+        const std::string& key = it.pNode->getkey();
+        _erase(key.data(), key.size());
+    }
+
+    template<typename T, typename Traits> 
+    size_t stringtrie<T, Traits>::erase(const key_type& k)
+    {
+        typename key_traits::bytes b(k);
+        return _erase(b.data(), b.size());
+    }
+
+    template<typename T, typename Traits> 
+    typename stringtrie<T, Traits>::size_type stringtrie<T, Traits>::_erase(const char *key, size_t len)
+    {
+        iterator it = find(key, len);
+        if (it == end())
+            return 0;
+        node_type *pNode = own(it.pNode);
+        pNode->bInUse = false;
+        --nsize;
+        bLinks = false;
+        addcount(pNode, -1);
+        prune(pNode);
+        return 1;
+    }
+
+    // Delete pNode, and then its parents, while they have no value and no children
+    template<typename T, typename Traits> 
+    void stringtrie<T, Traits>::prune(node_type *pNode)
+    {
+        while (pNode)
+        {
+            int tblidx = pNode->nextchild(0);
+            // The root is never deleted
+            if (RANGE == tblidx && pNode->bInUse == false && pNode->parent)
+            {
+                int idx = pNode->gettableindex();
+                pNode->parent->setchild(idx, NULL);
+                node_type *tmp = pNode;
+                pNode = pNode->parent;  // Do the loop again with the parent
+                node_type::release(tmp);
+                --numnodes;
+            }
+            else
+            {
+                pNode = NULL;   // break out of loop
+            }
+        }
+        // Space optimization todo:
+        // If this node has only one child, we might be able to combine nodes
+    }
+
+    template<typename T, typename Traits> 
+    typename stringtrie<T, Traits>::size_type stringtrie<T, Traits>::erase_prefix(const key_type& prefix)
+    {
+        node_type *pNode = _findprefix(prefix);
+        if (NULL == pNode)
+            return 0;
+        size_type n = nsize;
+        if (pNode == root)
+            clear();
+        else
+            detach(pNode);
+        return n - nsize;
+    }
+
+    // Walks [first, last) in order. A node whose subtree does not hold last is
+    // entirely in the range, so it is detached whole and the walk skips its subtree.
+    // Only the nodes above last are visited one by one.
+    template<typename T, typename Traits> 
+    void stringtrie<T, Traits>::erase(iterator first, iterator last)
+    {
+        node_type *pNode = first.pNode;
+        node_type *pLast = last.pNode;
+        while (pNode && pNode != pLast)
+        {
+            const std::string& key = pNode->nodeKey;
+            bool bAbove = pNode == root || (pLast && pLast->nodeKey.size() > key.size() 
+                && pLast->nodeKey.compare(0, key.size(), key) == 0);
+            if (bAbove)
+            {
+                if (pNode->hasValue())
+                {
+                    pNode = own(pNode);
+                    pNode->bInUse = false;
+                    --nsize;
+                    bLinks = false;
+                    addcount(pNode, -1);
+                }
+                pNode = next(pNode);
+            }
+            else
+            {
+                // The detached subtree is never above the next node, so next stays valid
+                node_type *pNext = next(pNode, RANGE);
+                detach(pNode);
+                pNode = pNext;
+            }
+        }
+    }
+
+    // Unlink pNode and its subtree from the trie and free them
+    template<typename T, typename Traits> 
+    void stringtrie<T, Traits>::detach(node_type *pNode)
+    {
+        node_type *pParent = own(pNode->parent);
+        pParent->setchild(pNode->gettableindex(), NULL);
+        size_type n = nsize;
+        discard(pNode);
+        addcount(pParent, -(ptrdiff_t)(n - nsize));
+        bLinks = false;
+        prune(pParent);
+    }
+
+    // Release a subtree that is no longer in the trie and take its nodes and values off
+    // numnodes and nsize. Nodes that only this trie refers to are counted as they are
+    // deleted, so the subtree is walked once. Nodes shared with a snapshot are counted
+    // and left to the snapshot.
+    template<typename T, typename Traits> 
+    void stringtrie<T, Traits>::discard(node_type *pNode)
+    {
+        --numnodes;
+        if (pNode->hasValue())
+            --nsize;
+        bool bShared = pNode->refcount != 1;
+        for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
+        {
+            node_type *pChild = pNode->getchild(i);
+            if (bShared)
+            {
+                countnodes(pChild);
+            }
+            else
+            {
+                pNode->setchild(i, NULL);
+                discard(pChild);
+            }
+        }
+        node_type::release(pNode);
+    }
+
+    template<typename T, typename Traits> 
+    void stringtrie<T, Traits>::countnodes(const node_type *pNode)
+    {
+        --numnodes;
+        if (pNode->hasValue())
+            --nsize;
+        for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
+            countnodes(pNode->getchild(i));
+    }
+
+    // Internal helper for lower_bound() and upper_bound(). The first node with a value at
+    // or after the key, see _boundnode()
+    template<typename T, typename Traits>
+    inline typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::_bound(const char *key, size_t len, bool bUpper)
+    {
+        return firstvalue(_boundnode(key, len, bUpper));
+    }
+
+    // Descend along the key until it leaves the trie, the answer is then the first node
+    // in depth first order at or after the point where it left. Depth first order is
+    // key order, so this is the first node whose key is not less than the search key.
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::_boundnode(const char *key, size_t len, bool bUpper)
+    {
+        node_type *pNode = root;
+        unsigned int pos = 0;
+        while (true)
+        {
+            const std::string& nodeKey = pNode->nodeKey;
+            unsigned int posPartialKey = pNode->posNodeKeyStart;
+            for (pos = node_type::skip(key, pos, len); posPartialKey < nodeKey.size() && pos < len; ++posPartialKey, pos = node_type::skip(key, pos + 1, len))
             {
-                return std::pair<const std::string, reference>(pNode->getkey(), pNode->getvalue());
+                if (nodeKey[posPartialKey] != Traits::fold(key[pos]))
+                    break;
             }
 
-            iterator operator++()
+            if (posPartialKey < nodeKey.size())
             {
-                if (pNode == NULL || pTrie == NULL)
-                    return *this;
-                pNode = pTrie->next(pNode);
-                while (pNode && pNode->hasValue() == false)
-                    pNode = pTrie->next(pNode);
-                return *this;
+                // The key ran out, or differs, part way through this node. Either every
+                // key in this subtree is greater than the search key or every one is less
+                if (pos == len || node_type::tableindex(Traits::fold(key[pos])) < (nodeKey[posPartialKey] & RANGE_MASK))
+                    return pNode;
+                if (NULL == pNode->parent)
+                    return NULL;
+                return next(pNode->parent, pNode->gettableindex() + 1);
             }
 
-            iterator operator++(int)
-            {            
-                if (pNode == NULL || pTrie == NULL)
-                    return *this;
-                iterator r = *this;
-                pNode = pTrie->next(pNode);
-                while (pNode && pNode->hasValue() == false)
-                    pNode = pTrie->next(pNode);
-                return r;
+            if (pos == len)
+            {
+                // This node is the key
+                if (bUpper)
+                    return next(pNode);
+                return pNode;
             }
 
-            bool operator==(const iterator& rhs) const
+            int tblidx = node_type::tableindex(Traits::fold(key[pos]));
+            if (tblidx == RANGE)
             {
-                if (pNode == rhs.pNode)
-                    return true;
-                return false;
+                // The character is above every slot, so is the rest of this subtree
+                return next(pNode, RANGE);
             }
-            
-            bool operator!=(const iterator& rhs) const
+            node_type *pChild = pNode->getchild(tblidx);
+            if (NULL == pChild)
             {
-                if (pNode != rhs.pNode)
-                    return true;
-                return false;
+                // Nothing in the trie continues with this character, the answer is
+                // the first child after it
+                return next(pNode, tblidx + 1);
             }
-
-        private:
-            friend class stringtrie<T>;
-            stringtrie<T> *pTrie;
-            stringtrie_node<T> *pNode;
-        };
-
-        stringtrie();
-        ~stringtrie();
-
-        // Not implemented
-        stringtrie(const stringtrie<T>& cc);
-
-        // Not implemented
-        stringtrie<T>& operator=(const stringtrie<T>& rhs);
-
-        std::pair<iterator, bool> insert(const value_type&);
-        void erase ( iterator position );
-        size_type erase ( const key_type& k );
-        size_type count ( const key_type& k ) const
-        {
-            iterator it = find(k);
-            if (it != end())
-                return 1;
-            return 0;
+            pNode = pChild;
         }
+    }
 
-        bool empty() const
+    // Returns the node whose subtree holds exactly the keys that start with prefix, or NULL
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::_findprefix(const key_type& k)
+    {
+        typename key_traits::bytes b(k);
+        const char *prefix = b.data();
+        size_t len = b.size();
+        node_type *pNode = root;
+        unsigned int pos = 0;
+        while (true)
         {
-            return nsize != 0;
+            const std::string& nodeKey = pNode->nodeKey;
+            unsigned int posPartialKey = pNode->posNodeKeyStart;
+            for (pos = node_type::skip(prefix, pos, len); posPartialKey < nodeKey.size() && pos < len; ++posPartialKey, pos = node_type::skip(prefix, pos + 1, len))
+            {
+                if (nodeKey[posPartialKey] != Traits::fold(prefix[pos]))
+                    return NULL;
+            }
+            if (pos == len)
+                return pNode;
+            int tblidx = node_type::tableindex(Traits::fold(prefix[pos]));
+            if (tblidx == RANGE)
+                return NULL;
+            pNode = pNode->getchild(tblidx);
+            if (NULL == pNode)
+                return NULL;
         }
+    }
 
-        void clear()
+    // Walk down from pNode using the subtree counts to find its n'th value
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::_nth(node_type *pNode, size_type n)
+    {
+        if (NULL == pNode || n >= pNode->getsubtreecount())
+            return NULL;
+        while (true)
         {
-            for (int i = 0; i < RANGE; ++i)
+            if (pNode->hasValue())
             {
-                if (root->table[i])
-                {
-                    delete root->table[i];
-                    root->table[i] = NULL;
-                }
+                if (n == 0)
+                    return pNode;
+                --n;
+            }
+            int tblidx = pNode->nextchild(0);
+            for (; tblidx < RANGE; tblidx = pNode->nextchild(tblidx + 1))
+            {
+                node_type *pChild = pNode->getchild(tblidx);
+                if (n < pChild->getsubtreecount())
+                    break;
+                n -= pChild->getsubtreecount();
             }
+            assert(tblidx < RANGE);
+            pNode = pNode->getchild(tblidx);
         }
+    }
 
-        iterator find(const std::string& key);
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::size_type stringtrie<T, Traits>::count_prefix(const key_type& prefix)
+    {
+        static_assert(Traits::SUBTREE_COUNTS != 0, "count_prefix() needs SUBTREE_COUNTS");
+        node_type *pNode = _findprefix(prefix);
+        if (NULL == pNode)
+            return 0;
+        return pNode->getsubtreecount();
+    }
 
-        inline T& operator[](const key_type& k)
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::size_type stringtrie<T, Traits>::rank(const key_type& k)
+    {
+        static_assert(Traits::SUBTREE_COUNTS != 0, "rank() needs SUBTREE_COUNTS");
+        typename key_traits::bytes b(k);
+        const char *key = b.data();
+        size_t len = b.size();
+        size_type n = 0;
+        node_type *pNode = root;
+        unsigned int pos = 0;
+        while (true)
         {
-            iterator i = find( k );
-           
-            if( i==end() )
+            const std::string& nodeKey = pNode->nodeKey;
+            unsigned int posPartialKey = pNode->posNodeKeyStart;
+            for (pos = node_type::skip(key, pos, len); posPartialKey < nodeKey.size() && pos < len; ++posPartialKey, pos = node_type::skip(key, pos + 1, len))
+            {
+                if (nodeKey[posPartialKey] != Traits::fold(key[pos]))
+                    break;
+            }
+
+            if (posPartialKey < nodeKey.size())
             {
-                std::pair<stringtrie<T>::iterator, bool> p = insert( value_type(k, T()) );
-                stringtrie<T>::iterator it = find(k);
-                return (*it).second;
+                // Every key in this subtree is on the same side of the search key
+                if (pos < len && node_type::tableindex(Traits::fold(key[pos])) > (nodeKey[posPartialKey] & RANGE_MASK))
+                    n += pNode->getsubtreecount();
+                return n;
             }
-            return (*i).second;
+            if (pos == len)
+                return n;
+
+            // This node's key is a prefix of the search key, so it and the children
+            // before the next character are all less
+            if (pNode->hasValue())
+                ++n;
+            // A character above every slot comes after all the children
+            int tblidx = node_type::tableindex(Traits::fold(key[pos]));
+            for (int i = pNode->nextchild(0); i < tblidx; i = pNode->nextchild(i + 1))
+                n += pNode->getchild(i)->getsubtreecount();
+            if (tblidx == RANGE)
+                return n;
+            pNode = pNode->getchild(tblidx);
+            if (NULL == pNode)
+                return n;
         }
+    }
 
-        size_t size() const
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::iterator stringtrie<T, Traits>::nth(size_type n)
+    {
+        static_assert(Traits::SUBTREE_COUNTS != 0, "nth() needs SUBTREE_COUNTS");
+        return iterator(this, _nth(root, n));
+    }
+
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::iterator stringtrie<T, Traits>::nth_with_prefix(const key_type& prefix, size_type n)
+    {
+        static_assert(Traits::SUBTREE_COUNTS != 0, "nth_with_prefix() needs SUBTREE_COUNTS");
+        return iterator(this, _nth(_findprefix(prefix), n));
+    }
+
+    // Best first. The queue holds subtrees, ranked by their best score, and values, ranked
+    // by their own score. A value comes out of the queue only when nothing left in it can
+    // score better, so the values come out in order.
+    template<typename T, typename Traits>
+    std::vector<typename stringtrie<T, Traits>::iterator> stringtrie<T, Traits>::top_k(const key_type& prefix, size_type k)
+    {
+        static_assert(Traits::SUBTREE_SCORES != 0, "top_k() needs SUBTREE_SCORES");
+        typedef typename node_type::score_type score_type;
+        struct candidate
         {
-            return nsize;
-        }
+            score_type score;
+            node_type *pNode;
+            bool bValue;        // The value of pNode rather than its subtree
 
-        iterator begin()
+            // Ties go to values so that they come out before the subtrees are opened
+            bool operator<(const candidate& rhs) const
+            {
+                if (score < rhs.score || rhs.score < score)
+                    return score < rhs.score;
+                return bValue == false && rhs.bValue;
+            }
+        };
+
+        std::vector<iterator> result;
+        node_type *pNode = _findprefix(prefix);
+        if (NULL == pNode || k == 0)
+            return result;
+        _rescore(pNode);
+
+        std::priority_queue<candidate> queue;
+        candidate c = { pNode->getsubtreescore(), pNode, false };
+        queue.push(c);
+        while (queue.empty() == false)
         {
-            node_type *pNode = next(root);
-            while (pNode->hasValue() == false)
-                pNode = next(pNode);
-            return iterator(this,pNode);
+            c = queue.top();
+            queue.pop();
+            if (c.bValue)
+            {
+                result.push_back(iterator(this, c.pNode));
+                if (result.size() == k)
+                    break;
+                continue;
+            }
+            pNode = c.pNode;
+            if (pNode->hasValue())
+            {
+                candidate v = { Traits::score(pNode->getvalue()), pNode, true };
+                queue.push(v);
+            }
+            for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
+            {
+                node_type *pChild = pNode->getchild(i);
+                candidate sub = { pChild->getsubtreescore(), pChild, false };
+                queue.push(sub);
+            }
         }
+        return result;
+    }
 
-        iterator end()
+    // Recompute the stale best scores in the subtree of pNode, children first. The children
+    // of a node that is not stale are not stale either. The scores are not seen by
+    // snapshots, so they are written in place even in nodes a snapshot shares.
+    template<typename T, typename Traits>
+    void stringtrie<T, Traits>::_rescore(node_type *pNode)
+    {
+        if (pNode->isscorestale() == false)
+            return;
+        bool bScored = pNode->hasValue();
+        if (bScored)
+            pNode->bestscore = Traits::score(pNode->getvalue());
+        for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
         {
-            return iterator();
+            node_type *pChild = pNode->getchild(i);
+            _rescore(pChild);
+            if (bScored == false || pNode->bestscore < pChild->bestscore)
+                pNode->bestscore = pChild->bestscore;
+            bScored = true;
         }
+        pNode->bStale = false;
+    }
 
-        int getmemusage() const;
-        int getnumnodes() const;
+    // Breadth first over the states, one depth at a time, so the failure links of every
+    // shorter state are set before they are followed. level holds the nodes with a state
+    // at the current depth.
+    template<typename T, typename Traits>
+    void stringtrie<T, Traits>::buildlinks()
+    {
+        static_assert(Traits::SCAN_LINKS != 0, "buildlinks() needs SCAN_LINKS");
+        std::vector<node_type *> level;
+        std::vector<node_type *> nextlevel;
+        for (int i = root->nextchild(0); i < RANGE; i = root->nextchild(i + 1))
+            level.push_back(root->getchild(i));
 
-    private:
-        node_type *root;
-        int numnodes;
-        size_t nsize;
-    private:
-        unsigned int substrlength(const std::string& s1, const std::string& s2);
-        node_type *next(node_type *current)
+        for (unsigned int depth = 1; level.empty() == false; ++depth)
         {
-            node_type *pn = current;
-            int tblidx = 0;
-            while (pn)
+            nextlevel.clear();
+            for (size_t n = 0; n < level.size(); ++n)
             {
-                // depth first
-                for (; tblidx < RANGE; ++tblidx)
+                node_type *pNode = level[n];
+                if (depth == pNode->posNodeKeyStart + 1)
+                    pNode->links.resize(pNode->nodeKey.size() - pNode->posNodeKeyStart);
+                stringtrie_link<node_type>& l = getlink(pNode, depth);
+                char c = pNode->nodeKey[depth - 1];
+
+                // Follow the failure links of the state one character shorter until c
+                // leads somewhere, at worst the root
+                node_type *pFail = root;
+                unsigned int faildepth = 0;
+                if (depth > 1)
                 {
-                    if (pn->table[tblidx])
+                    node_type *pPrev = (depth - 1 > pNode->posNodeKeyStart) ? pNode : pNode->parent;
+                    pFail = getlink(pPrev, depth - 1).pFail;
+                    faildepth = getlink(pPrev, depth - 1).faildepth;
+                    while (advance(pFail, faildepth, c) == false && faildepth)
                     {
-                        return pn->table[tblidx];
+                        const stringtrie_link<node_type>& f = getlink(pFail, faildepth);
+                        pFail = f.pFail;
+                        faildepth = f.faildepth;
                     }
                 }
-                if (NULL == pn->parent)
+                l.pFail = pFail;
+                l.faildepth = faildepth;
+                l.pOutput = NULL;
+                if (faildepth)
                 {
-                    return NULL;
+                    if (faildepth == pFail->nodeKey.size() && pFail->hasValue())
+                        l.pOutput = pFail;
+                    else
+                        l.pOutput = getlink(pFail, faildepth).pOutput;
+                }
+
+                if (depth < pNode->nodeKey.size())
+                {
+                    nextlevel.push_back(pNode);
+                }
+                else
+                {
+                    for (int i = pNode->nextchild(0); i < RANGE; i = pNode->nextchild(i + 1))
+                        nextlevel.push_back(pNode->getchild(i));
                 }
-                // Get the index this node is in the parent
-                tblidx = pn->gettableindex();
-                ++tblidx;
-                pn = pn->parent;
             }
-            return NULL;
+            level.swap(nextlevel);
         }
-    };
-
-    //=================================================================
-    // stringtrie
-    //=================================================================
-    template<typename T>
-    inline stringtrie<T>::stringtrie()
-        : root(NULL)
-        , numnodes(0)
-        , nsize(0)
-    {
-        root = new node_type();
+        bLinks = true;
     }
 
-    template<typename T>
-    stringtrie<T>::~stringtrie()
+    template<typename T, typename Traits>
+    template<typename Fn>
+    size_t stringtrie<T, Traits>::scan(const char *text, size_t len, Fn callback)
     {
-        delete root;
-    }
-
-    template<typename T>
-    inline int stringtrie<T>::getmemusage( ) const
-    {
-        return this->numnodes * sizeof(node_type);
-    }
+        static_assert(Traits::SCAN_LINKS != 0, "scan() needs SCAN_LINKS");
+        if (false == bLinks)
+            buildlinks();
+
+        size_t nmatches = 0;
+        node_type *pNode = root;
+        unsigned int depth = 0;
+        const node_type *pRoot = root;
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (0 == depth)
+            {
+                // Most text does not start a key, skip it with the root's table alone
+                while (i < len && NULL == pRoot->getchild(text[i] & RANGE_MASK))
+                    ++i;
+                if (i == len)
+                    break;
+            }
+            char c = text[i];
+            while (advance(pNode, depth, c) == false)
+            {
+                if (0 == depth)
+                    break;
+                const stringtrie_link<node_type>& l = getlink(pNode, depth);
+                pNode = l.pFail;
+                depth = l.faildepth;
+            }
+            if (0 == depth)
+                continue;
 
-    template<typename T>
-    inline int stringtrie<T>::getnumnodes( ) const
-    {
-        return this->numnodes;
+            // This state, then every shorter key that ends here
+            if (depth == pNode->nodeKey.size() && pNode->hasValue())
+            {
+                ++nmatches;
+                callback(i + 1 - depth, (size_t)depth, (const T&)pNode->getvalue());
+            }
+            for (node_type *pOut = getlink(pNode, depth).pOutput; pOut; pOut = pOut->links.back().pOutput)
+            {
+                ++nmatches;
+                size_t keylen = pOut->nodeKey.size();
+                callback(i + 1 - keylen, keylen, (const T&)pOut->getvalue());
+            }
+        }
+        return nmatches;
     }
 
-    template<typename T>
-    inline typename stringtrie<T>::iterator stringtrie<T>::find( const std::string& key )
+    template<typename T, typename Traits>
+    template<typename Combine>
+    void stringtrie<T, Traits>::merge(stringtrie<T, Traits>& other, Combine combine)
     {
-        int pos = 0;
-        node_type *pNode = root->_find(key, pos);
-        if (pNode == NULL || pNode->hasValue() == false)
-            return end();
-        return iterator(this, pNode);
+        if (this == &other)
+            return;
+        root = own(root);
+        bLinks = false;
+        mergestats stats;
+        _merge(root, other.root, 0, true, combine, stats);
+        nsize += other.nsize - stats.ncollisions;
+        // The other root is dropped but was never counted as a node
+        numnodes += other.numnodes - (stats.ndropped - 1) + stats.nadded;
+
+        // The nodes that were spliced in hold a reference of their own now, clearing
+        // other only frees what was merged
+        other.clear();
     }
 
-    template<typename T>
-    inline std::pair<typename stringtrie<T>::iterator, bool> stringtrie<T>::insert(const value_type& v)
+    // Merge the subtree of b into the subtree of a. Both keys match up to pos, a is 
+    // private to this trie. If bMove b's nodes are taken, otherwise they are copied.
+    template<typename T, typename Traits>
+    template<typename Combine>
+    void stringtrie<T, Traits>::_merge(node_type *a, node_type *b, unsigned int pos, bool bMove, Combine& combine, mergestats& stats)
     {
-        ++nsize;
-        const string& key = v.first;
-        const T& value = v.second;
+        const std::string& keyA = a->nodeKey;
+        const std::string& keyB = b->nodeKey;
+        unsigned int p = pos;
+        while (p < keyA.size() && p < keyB.size() && keyA[p] == keyB[p])
+            ++p;
 
-        // Find the deepest node that at least partially
-        // matches the key
-        node_type *pNode = root->_findpartial(key, 0);
+        if (p < keyA.size())
+        {
+            // b leaves a part way through a's key, split a so there is a node at p
+            node_type *pNewParentNode = newnode();
+            ++stats.nadded;
+            pNewParentNode->parent = a->parent;
+            pNewParentNode->nodeKey = keyA.substr(0, p);
+            pNewParentNode->posNodeKeyStart = a->posNodeKeyStart;
+            a->parent->addchild(pNewParentNode);
+            a->parent = pNewParentNode;
+            a->posNodeKeyStart = p;
+            pNewParentNode->addchild(a);
+            a = pNewParentNode;
+        }
 
-        if (pNode->getkey() == key)
+        if (p == keyB.size())
         {
-            if (pNode->bInUse)
+            // a and b are the same key
+            if (b->hasValue())
+            {
+                if (a->hasValue())
+                {
+                    a->value = combine(a->value, b->value);
+                    ++stats.ncollisions;
+                }
+                else
+                {
+                    a->setvalue(b->value);
+                }
+            }
+            if (bMove)
+                ++stats.ndropped;
+            for (int i = b->nextchild(0); i < RANGE; i = b->nextchild(i + 1))
             {
-                --nsize;
-                return std::pair<iterator, bool>(iterator(), false);   // key exists;
+                if (a->getchild(i))
+                    _merge(own(a->getchild(i)), b->getchild(i), p, bMove, combine, stats);
+                else
+                    attach(a, b->getchild(i), p, bMove, stats);
             }
-            pNode->setvalue(value);
-            return std::pair<iterator, bool>(iterator(this, pNode), true);
         }
-
-        unsigned int pos = substrlength(pNode->getkey(), key);
-        if (pos == pNode->getkey().length())
+        else
         {
-            //The new key is a superset of this node's key, this will be easy...
-            node_type *pNewChildNode = new node_type();
-            ++numnodes;
-            pNewChildNode->nodeKey = key;
-            pNewChildNode->posNodeKeyStart = pos;
-            pNewChildNode->parent = pNode;
-            pNewChildNode->setvalue(value);
-            pNode->addchild(pNewChildNode);
-            return std::pair<iterator, bool>(iterator(this, pNode), true);
+            // b continues below a
+            int tblidx = keyB[p] & RANGE_MASK;
+            if (a->getchild(tblidx))
+                _merge(own(a->getchild(tblidx)), b, p, bMove, combine, stats);
+            else
+                attach(a, b, p, bMove, stats);
         }
-        // We need to split this node
-        // Insert a new node 
-        node_type *orig_parent = pNode->parent;
-        node_type *pNewParentNode = new node_type();
-        ++numnodes;
-        pNewParentNode->parent = pNode->parent;        
-        pNewParentNode->nodeKey = pNode->getkey().substr(0, pos);
-        pNewParentNode->posNodeKeyStart = pNode->posNodeKeyStart;
-        orig_parent->addchild(pNewParentNode);       
-
-        pNode->parent = pNewParentNode;
-        pNode->posNodeKeyStart = pos;
-
-        pNewParentNode->addchild(pNode);
+        recount(a);
+    }
 
-        // Now add the new node
-        pNode = new node_type();
-        ++numnodes;
-        pNode->parent = pNewParentNode;
-        pNode->setvalue(value);
-        pNode->nodeKey = key;
+    // Put the subtree b, which is not in this trie, under pParent. Its key starts at pos.
+    template<typename T, typename Traits>
+    void stringtrie<T, Traits>::attach(node_type *pParent, node_type *b, unsigned int pos, bool bMove, mergestats& stats)
+    {
+        node_type *pNode;
+        if (bMove == false)
+        {
+            pNode = clone(b, pParent, &stats.nadded);
+        }
+        else if (b->posNodeKeyStart == pos)
+        {
+            // Splice, the other trie's reference is dropped when it is cleared
+            ++b->refcount;
+            pNode = b;
+        }
+        else
+        {
+            // b's key would start at a different place here, which snapshots of the 
+            // other trie may not see, so it is copied. The children are still shared.
+            pNode = copynode(b);
+        }
+        pNode->parent = pParent;
         pNode->posNodeKeyStart = pos;
-        pNewParentNode->addchild(pNode);
-        return std::pair<iterator, bool>(iterator(this, pNode), true);
+        pParent->addchild(pNode);
     }
 
-    template<typename T> 
-    void stringtrie<T>::erase(typename stringtrie<T>::iterator it)
+    // Returns a copy of the subtree a without the keys that are in the subtree b, or NULL
+    // if nothing is left. The keys of a and b match up to pos. Where b has nothing
+    // below a node of a the rest of a is copied whole.
+    template<typename T, typename Traits>
+    typename stringtrie<T, Traits>::node_type *stringtrie<T, Traits>::_subtract(const node_type *a, const node_type *b, unsigned int pos, node_type *pParent, mergestats& stats)
     {
-        erase((*it).first);
+        const std::string& keyA = a->nodeKey;
+        const std::string& keyB = b->nodeKey;
+        unsigned int p = pos;
+        while (p < keyA.size() && p < keyB.size() && keyA[p] == keyB[p])
+            ++p;
+
+        if (p < keyA.size())
+        {
+            if (p < keyB.size())
+                return clone(a, pParent, &stats.nadded);
+            // b's key is a prefix of a's, look for a below b
+            const node_type *pChild = b->getchild(keyA[p] & RANGE_MASK);
+            if (NULL == pChild)
+                return clone(a, pParent, &stats.nadded);
+            return _subtract(a, pChild, p, pParent, stats);
+        }
+
+        // a's key is the same as b's or a prefix of it
+        node_type *pNode = newnode();
+        ++stats.nadded;
+        pNode->parent = pParent;
+        pNode->nodeKey = keyA;
+        pNode->posNodeKeyStart = a->posNodeKeyStart;
+        if (a->hasValue())
+        {
+            if (p == keyB.size() && b->hasValue())
+                ++stats.ncollisions;
+            else
+                pNode->setvalue(a->value);
+        }
+        bool bChildren = false;
+        for (int i = a->nextchild(0); i < RANGE; i = a->nextchild(i + 1))
+        {
+            const node_type *pChild = a->getchild(i);
+            node_type *pCopy;
+            if (p == keyB.size() && b->getchild(i))
+                pCopy = _subtract(pChild, b->getchild(i), p, pNode, stats);
+            else if (p < keyB.size() && i == (keyB[p] & RANGE_MASK))
+                pCopy = _subtract(pChild, b, p, pNode, stats);
+            else
+                pCopy = clone(pChild, pNode, &stats.nadded);
+            pNode->setchild(i, pCopy);
+            if (pCopy)
+                bChildren = true;
+        }
+        if (bChildren == false && pNode->hasValue() == false)
+        {
+            node_type::release(pNode);
+            --stats.nadded;
+            return NULL;
+        }
+        recount(pNode);
+        return pNode;
     }
 
-    template<typename T> 
-    size_t stringtrie<T>::erase(const key_type& k)
+    // Walks two subtrees whose keys match up to pos and calls fn(a, b) for each pair of
+    // nodes with the same key. Parts of a and b that the other does not have are skipped.
+    template<typename T, typename Traits>
+    template<typename Fn>
+    void stringtrie<T, Traits>::_join(node_type *a, node_type *b, unsigned int pos, Fn& fn)
     {
-        iterator it = find(k);
-        if (it == end())
-            return 0;
-        node_type *pNode = it.pNode;
-        pNode->bInUse = false;
-        --nsize;
+        const std::string& keyA = a->nodeKey;
+        const std::string& keyB = b->nodeKey;
+        unsigned int p = pos;
+        while (p < keyA.size() && p < keyB.size() && keyA[p] == keyB[p])
+            ++p;
 
-        // If this node has no children, delete it
-        while (pNode)
+        if (p == keyA.size() && p == keyB.size())
         {
-            int tblidx = 0;
-            for (tblidx = 0; tblidx < RANGE; ++tblidx)
-            {
-                if (pNode->table[tblidx])
-                {
-                    break;
-                }
-            }
-            if (RANGE == tblidx && pNode->bInUse == false)
-            {
-                if (pNode->parent)
-                {
-                    int idx = pNode->gettableindex();
-                    pNode->parent->table[idx] = NULL;
-                }
-                node_type *tmp = pNode;
-                pNode = pNode->parent;  // Do the loop again with the parent
-                delete tmp;
-                --numnodes;
-            }
-            else
+            fn(a, b);
+            for (int i = a->nextchild(0); i < RANGE; i = a->nextchild(i + 1))
             {
-                pNode = NULL;   // break out of loop
+                if (b->getchild(i))
+                    _join(a->getchild(i), b->getchild(i), p, fn);
             }
         }
-        // Space optimization todo:
-        // If this node has only one child, we might be able to combine nodes
-        return 1;
+        else if (p == keyA.size())
+        {
+            node_type *pChild = a->getchild(keyB[p] & RANGE_MASK);
+            if (pChild)
+                _join(pChild, b, p, fn);
+        }
+        else if (p == keyB.size())
+        {
+            node_type *pChild = b->getchild(keyA[p] & RANGE_MASK);
+            if (pChild)
+                _join(a, pChild, p, fn);
+        }
+        // Otherwise the keys differ at p and the subtrees have nothing in common
     }
 
     // Returns the number of characters of s1 contained in s2
-    template<typename T> 
-    unsigned int stringtrie<T>::substrlength(const std::string& s1, const std::string& s2)
+    template<typename T, typename Traits> 
+    unsigned int stringtrie<T, Traits>::substrlength(const std::string& s1, const char *s2, unsigned int len2)
     {
         unsigned int p1 = 0;
         unsigned int p2 = 0;
-        for (; p1 < s1.length() && p2 < s2.length(); ++p1, ++p2)
+        for (; p1 < s1.length() && p2 < len2; ++p1, ++p2)
         {
             if (s1[p1] != s2[p2])
                 break;
@@ -497,65 +2720,82 @@ namespace tt_coreutils_ns
     // stringtrie
     //=================================================================
 
-    template<typename T>
-    stringtrie_node<T>::stringtrie_node()
+    template<typename T, typename Traits>
+    stringtrie_node<T, Traits>::stringtrie_node()
         :parent(0)
+        , posNodeKeyStart(0) 
         , value(T())
         , bInUse(false)
-        , posNodeKeyStart(0) 
+        , refcount(1)
+        , gen(0)
+        , pArena(NULL)
+    {
+    }
+
+    template<typename T, typename Traits>
+    stringtrie_node<T, Traits>::~stringtrie_node()
     {
-        memset(table, 0, sizeof(table));
+        for (int i = nextchild(0); i < RANGE; i = nextchild(i + 1))
+            release(getchild(i));
     }
 
-    template<typename T>
-    stringtrie_node<T>::~stringtrie_node()
+    template<typename T, typename Traits>
+    inline void stringtrie_node<T, Traits>::release(node_type *pNode)
     {
-        for (int i = 0; i < RANGE; ++i)
+        if (--pNode->refcount == 0)
         {
-            delete table[i];
+            stringtrie_arena<node_type> *pArena = pNode->pArena;
+            if (NULL == pArena)
+            {
+                delete pNode;
+                return;
+            }
+            pNode->~node_type();
+            pArena->release();
         }
     }
 
-    template<typename T>
-    inline const std::string& stringtrie_node<T>::getkey() const
+    template<typename T, typename Traits>
+    inline const std::string& stringtrie_node<T, Traits>::getkey() const
     {
         return nodeKey;
     }
 
-    template<typename T>
-    inline int stringtrie_node<T>::gettableindex() const
+    template<typename T, typename Traits>
+    inline int stringtrie_node<T, Traits>::gettableindex() const
     {
         return nodeKey[posNodeKeyStart] & RANGE_MASK;
     }
 
-    template<typename T>
-    inline void stringtrie_node<T>::setvalue(const value_type& v)
+    template<typename T, typename Traits>
+    inline void stringtrie_node<T, Traits>::setvalue(const value_type& v)
     {
         value = v;
         bInUse = true;
     }
 
-    template<typename T>
-    inline void stringtrie_node<T>::addchild(typename stringtrie_node<T>::node_type *pNode)
+    template<typename T, typename Traits>
+    inline void stringtrie_node<T, Traits>::addchild(typename stringtrie_node<T, Traits>::node_type *pNode)
     {
-        table[pNode->gettableindex()] = pNode;
+        setchild(pNode->gettableindex(), pNode);
     }
 
     // Internal helper function. Given a key, this will return the deepest node that contains
     // at least a partial match. insert() uses this to find the node where a new key should be added
-    template<typename T>
-    inline typename stringtrie_node<T>::node_type *stringtrie_node<T>::_findpartial( const std::string& key, unsigned int pos )
+    template<typename T, typename Traits>
+    inline typename stringtrie_node<T, Traits>::node_type *stringtrie_node<T, Traits>::_findpartial( const char *key, unsigned int len, unsigned int pos )
     {
         unsigned int posPartialKey = posNodeKeyStart;
 
-        for (; posPartialKey < nodeKey.size() && pos < key.length(); ++posPartialKey, ++pos)
+        // The stored key is normalized, the search key is normalized as it is read
+        for (pos = skip(key, pos, len); posPartialKey < nodeKey.size() && pos < len; ++posPartialKey, pos = skip(key, pos + 1, len))
         {
-            if (nodeKey[posPartialKey] != key[pos])
+            if (nodeKey[posPartialKey] != Traits::fold(key[pos]))
                 break;
         }
 
         // We matched the entire search key and the entire node key so we match
-        if (pos == key.length() && posPartialKey == nodeKey.length())
+        if (pos == len && posPartialKey == nodeKey.length())
         {
             return this;
         }
@@ -567,30 +2807,32 @@ namespace tt_coreutils_ns
         }
 
         // We still have some 'key' left over so dive into a child
-        node_type *t = this->table[key[pos]];
+        int tblidx = tableindex(Traits::fold(key[pos]));
+        node_type *t = tblidx < RANGE ? this->getchild(tblidx) : NULL;
         if (NULL == t)
         {
             // No child nodes, return this
             return this;
         }
-        return t->_findpartial(key, pos);
+        return t->_findpartial(key, len, pos);
     }
 
     // TODO: Unroll this to remove recursion
-    template<typename T>
-    inline typename stringtrie_node<T>::node_type *stringtrie_node<T>::_find( const std::string& key, unsigned int pos )
+    template<typename T, typename Traits>
+    inline typename stringtrie_node<T, Traits>::node_type *stringtrie_node<T, Traits>::_find( const char *key, unsigned int len, unsigned int pos )
     {
         node_type * t = this;
         unsigned int posPartialKey = posNodeKeyStart;
 
-        for (; posPartialKey < nodeKey.size() && pos < key.length(); ++posPartialKey, ++pos)
+        // The stored key is normalized, the search key is normalized as it is read
+        for (pos = skip(key, pos, len); posPartialKey < nodeKey.size() && pos < len; ++posPartialKey, pos = skip(key, pos + 1, len))
         {
-            if (nodeKey[posPartialKey] != key[pos])
+            if (nodeKey[posPartialKey] != Traits::fold(key[pos]))
                 break;
         }
 
         // We matched the entire search key and the entire node key so we match
-        if (pos == key.length() && posPartialKey == nodeKey.length())
+        if (pos == len && posPartialKey == nodeKey.length())
         {
             return this;
         }
@@ -602,13 +2844,16 @@ namespace tt_coreutils_ns
         }
 
         // We still have some 'key' left over so dive into a child
-        t = t->table[key[pos]];
+        int tblidx = tableindex(Traits::fold(key[pos]));
+        if (tblidx == RANGE)
+            return NULL;
+        t = t->getchild(tblidx);
         if (NULL == t)
         {
             // No child nodes, we fail
             return NULL;
         }
-        return t->_find(key, pos);
+        return t->_find(key, len, pos);
     }
 }   // namespace tt_coreutils_ns
 #endif _STRING_TRIE_H_
@@ -0,0 +1,136 @@
+#ifndef _STRING_TRIE_LOADER_H_
+#define _STRING_TRIE_LOADER_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "stringtrie.h"
+
+/******************************************************************************************
+ * stringtrie_load
+ *
+ * Loads a delimiter separated reference data file into a stringtrie. Each line is a key,
+ * a field separator and the rest of the fields, for example the product tables:
+ *
+ *     ESZ5;CME;Future;...
+ *
+ * The file is read in large chunks (LOAD_CHUNK) with the stdio buffer turned off, so each
+ * byte is copied once, from the file into the chunk. Line and field separators are found
+ * with memchr(), which the C runtime vectorizes. The key is passed to the trie straight
+ * from the chunk and is copied only into the nodes the trie creates, there are no
+ * intermediate strings. Lines may be any length, the chunk grows to hold the longest line.
+ *
+ * The value of each key comes from an extractor, a functor called as
+ *
+ *     T extract(const char *key, size_t keylen, const char *fields, size_t fieldslen)
+ *
+ * where fields is the rest of the line after the key and its separator (without the line
+ * separator or a trailing '\r'). The default extractor gives T().
+ *
+ * If a key is repeated the first line wins, the same as insert(). A line whose key has a
+ * character the trie has no slot for, such as a byte above 0x7f in a text trie, is skipped
+ * and counted in stringtrie_loadstats::rejected.
+ *
+ * ****************************************************************************************/
+
+namespace tt_coreutils_ns
+{
+    enum {
+        LOAD_CHUNK = 4 * 1024 * 1024
+    };
+
+    struct stringtrie_loadstats
+    {
+        stringtrie_loadstats() : bytes(0), lines(0), keys(0), rejected(0) {}
+        size_t bytes;       // Bytes read from the file
+        size_t lines;       // Lines with a key
+        size_t keys;        // Keys inserted, repeated keys are not counted
+        size_t rejected;    // Lines skipped because the trie cannot hold their key
+    };
+
+    // The default extractor, every key gets T()
+    template<typename T>
+    struct stringtrie_novalue
+    {
+        T operator()(const char *, size_t, const char *, size_t) const
+        {
+            return T();
+        }
+    };
+
+    // Split one line into the key and the other fields and insert it
+    template<typename T, typename Traits, typename Extract>
+    inline void stringtrie_loadline(const char *line, size_t len, char fieldsep, stringtrie<T, Traits>& trie, Extract& extract, stringtrie_loadstats& stats)
+    {
+        if (len && line[len - 1] == '\r')
+            --len;
+        const char *sep = (const char *)memchr(line, fieldsep, len);
+        size_t keylen = sep ? sep - line : len;
+        if (keylen == 0)
+            return;
+        const char *fields = sep ? sep + 1 : line + len;
+        size_t fieldslen = line + len - fields;
+        ++stats.lines;
+        if (trie.validkey(line, keylen) == false)
+        {
+            ++stats.rejected;
+            return;
+        }
+        if (trie.insert(line, keylen, extract(line, keylen, fields, fieldslen)).second)
+            ++stats.keys;
+    }
+
+    // Returns false if the file could not be read
+    template<typename T, typename Traits, typename Extract>
+    bool stringtrie_load(const char *filename, stringtrie<T, Traits>& trie, Extract extract, char fieldsep = ';', char linesep = '\n', stringtrie_loadstats *pStats = NULL)
+    {
+        FILE *fp = fopen(filename, "rb");
+        if (NULL == fp)
+            return false;
+        setvbuf(fp, NULL, _IONBF, 0);
+
+        stringtrie_loadstats stats;
+        std::vector<char> chunk(LOAD_CHUNK);
+        size_t carry = 0;       // The start of a line that did not fit in the last chunk
+        while (true)
+        {
+            size_t n = fread(&chunk[carry], 1, chunk.size() - carry, fp);
+            stats.bytes += n;
+            if (n == 0)
+            {
+                // The last line may not have a separator
+                if (carry)
+                    stringtrie_loadline(&chunk[0], carry, fieldsep, trie, extract, stats);
+                break;
+            }
+
+            const char *p = &chunk[0];
+            const char *end = p + carry + n;
+            while (true)
+            {
+                const char *eol = (const char *)memchr(p, linesep, end - p);
+                if (NULL == eol)
+                    break;
+                stringtrie_loadline(p, eol - p, fieldsep, trie, extract, stats);
+                p = eol + 1;
+            }
+
+            carry = end - p;
+            memmove(&chunk[0], p, carry);
+            if (carry == chunk.size())
+                chunk.resize(chunk.size() * 2);
+        }
+        bool bOk = ferror(fp) == 0;
+        fclose(fp);
+        if (pStats)
+            *pStats = stats;
+        return bOk;
+    }
+
+    template<typename T, typename Traits>
+    bool stringtrie_load(const char *filename, stringtrie<T, Traits>& trie, char fieldsep = ';', char linesep = '\n', stringtrie_loadstats *pStats = NULL)
+    {
+        return stringtrie_load(filename, trie, stringtrie_novalue<T>(), fieldsep, linesep, pStats);
+    }
+}   // namespace tt_coreutils_ns
+#endif
@@ -0,0 +1,502 @@
+#ifndef _STRING_TRIE_LOG_H_
+#define _STRING_TRIE_LOG_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "stringtrie.h"
+
+/******************************************************************************************
+ * stringtrie_log
+ *
+ * Write-ahead mutation log with checkpoints, so the changes made to a stringtrie survive
+ * a restart. Changes made through the log (insert(), assign() and erase()) are applied to
+ * the trie and appended to the log as compact binary records. Changes made directly on the
+ * trie are not logged.
+ *
+ * Group commit:
+ *
+ * Records are collected in memory and written and synced together when BATCH_BYTES of them
+ * are waiting, or when commit() is called. A change is durable once commit() returns, a
+ * crash can lose the changes since the last commit().
+ *
+ * Checkpoints:
+ *
+ * When the log grows past CHECKPOINT_BYTES, or checkpoint() is called, the whole trie is
+ * written to <path>.ckpt and a new log is started. The trie is written from a snapshot(),
+ * so the contents are consistent. The checkpoint is written to a temporary file and
+ * renamed over the old one, then the logs before it are deleted. The directory is synced
+ * after a log is created and after the rename, so the new names survive a crash too. If a
+ * crash comes before the old logs are deleted, open() deletes them.
+ *
+ * Files:
+ *
+ *   <path>.ckpt      The trie as of the start of log <n>, n is in the header
+ *   <path>.<n>.log   The changes after checkpoint n
+ *
+ * Recovery:
+ *
+ * open() loads the checkpoint and replays the logs from its number onwards. Each record
+ * ends with a checksum, replay stops at the first record that is incomplete or does not
+ * match, which is where a crash interrupted a write. If that happens a new checkpoint is
+ * written so the damaged log is never appended to.
+ *
+ * Record format, lengths are 7 bits per byte, low bits first:
+ *
+ *   op (1 byte, 'I' insert, 'A' assign, 'E' erase)
+ *   key length, key
+ *   value length, value (not for erase)
+ *   FNV-1a hash of the above (4 bytes, little endian)
+ *
+ * Values are written by the Codec, the default copies the bytes of T, which suits the
+ * plain types and structs that are normally kept in the trie.
+ *
+ * ****************************************************************************************/
+
+namespace tt_coreutils_ns
+{
+    // Values are written as their bytes, for types that can be copied with memcpy
+    template<typename T>
+    struct stringtrie_podcodec
+    {
+        static void encode(const T& v, std::string& out)
+        {
+            out.append((const char *)&v, sizeof(T));
+        }
+
+        static bool decode(const char *p, size_t len, T& v)
+        {
+            if (len != sizeof(T))
+                return false;
+            memcpy(&v, p, len);
+            return true;
+        }
+    };
+
+    // Make sure the data written to fp has reached the disk
+    inline bool stringtrie_sync(FILE *fp)
+    {
+        if (fflush(fp) != 0)
+            return false;
+#ifdef _WIN32
+        return _commit(_fileno(fp)) == 0;
+#else
+        return fsync(fileno(fp)) == 0;
+#endif
+    }
+
+    // Make sure the files created or renamed in the directory of name are on the disk,
+    // syncing a file does not sync its directory entry. Windows cannot sync a directory,
+    // NTFS journals the entries itself.
+    inline bool stringtrie_syncdir(const std::string& name)
+    {
+#ifdef _WIN32
+        return true;
+#else
+        std::string::size_type slash = name.rfind('/');
+        std::string dir = std::string::npos == slash ? "." : name.substr(0, slash + 1);
+        int fd = ::open(dir.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        bool bOk = fsync(fd) == 0;
+        ::close(fd);
+        return bOk;
+#endif
+    }
+
+    template<typename T, typename Traits = stringtrie_traits, typename Codec = stringtrie_podcodec<T> >
+    class stringtrie_log
+    {
+    public:
+        typedef stringtrie<T, Traits> trie_type;
+        typedef typename trie_type::value_type value_type;
+        typedef typename trie_type::key_type key_type;
+        typedef typename trie_type::iterator iterator;
+        typedef typename trie_type::size_type size_type;
+
+        enum {
+            BATCH_BYTES = 64 * 1024
+            , CHECKPOINT_BYTES = 64 * 1024 * 1024
+            , WRITE_CHUNK = 1024 * 1024         // Checkpoints are written in pieces this size
+        };
+
+        stringtrie_log(trie_type& t, const std::string& p)
+            :trie(t)
+            , path(p)
+            , fp(NULL)
+            , lognum(0)
+            , firstlog(0)
+            , logbytes(0)
+            , batchbytes(BATCH_BYTES)
+            , checkpointbytes(CHECKPOINT_BYTES)
+        {
+        }
+
+        ~stringtrie_log()
+        {
+            close();
+        }
+
+        // Load the checkpoint and replay the logs into the trie, which should be empty,
+        // then open the log for new records. Returns false if the files could not be read
+        // or written.
+        bool open();
+
+        // Commit and close the log
+        bool close();
+
+        std::pair<iterator, bool> insert(const value_type& v)
+        {
+            std::pair<iterator, bool> r = trie.insert(v);
+            if (r.second)
+                append('I', v.first, &v.second);
+            return r;
+        }
+
+        // Insert or replace the value of k
+        void assign(const key_type& k, const T& v)
+        {
+            iterator it = trie.find(k);
+            if (it == trie.end())
+                trie.insert(value_type(k, v));
+            else
+                it.value() = v;
+            append('A', k, &v);
+        }
+
+        size_type erase(const key_type& k)
+        {
+            size_type n = trie.erase(k);
+            if (n)
+                append('E', k, NULL);
+            return n;
+        }
+
+        // Write and sync the records that are waiting
+        bool commit();
+
+        // Write the trie to the checkpoint file and start a new log
+        bool checkpoint();
+
+        void setbatchbytes(size_t n) { batchbytes = n; }
+        // The checkpoint is written by the insert(), assign() or erase() whose commit takes
+        // the log past n bytes, so that call takes as long as writing and syncing the whole
+        // trie. Set n high and call checkpoint() when a pause is acceptable to avoid this.
+        void setcheckpointbytes(size_t n) { checkpointbytes = n; }
+
+    private:
+        trie_type& trie;
+        std::string path;
+        FILE *fp;
+        unsigned int lognum;        // The log being written
+        unsigned int firstlog;      // The oldest log that has not been deleted
+        size_t logbytes;            // The size of the log being written
+        size_t batchbytes;
+        size_t checkpointbytes;
+        std::string batch;          // Records that have not been written
+        std::string scratch;        // Encoded value
+
+        stringtrie_log(const stringtrie_log&);
+        stringtrie_log& operator=(const stringtrie_log&);
+
+        std::string logname(unsigned int n) const
+        {
+            char buf[32];
+            sprintf(buf, ".%u.log", n);
+            return path + buf;
+        }
+
+        std::string checkpointname() const
+        {
+            return path + ".ckpt";
+        }
+
+        static unsigned int hash(const char *p, size_t len)
+        {
+            unsigned int h = 2166136261u;
+            for (size_t i = 0; i < len; ++i)
+            {
+                h ^= (unsigned char)p[i];
+                h *= 16777619u;
+            }
+            return h;
+        }
+
+        static void putlength(std::string& out, size_t n)
+        {
+            while (n >= 0x80)
+            {
+                out += (char)(n | 0x80);
+                n >>= 7;
+            }
+            out += (char)n;
+        }
+
+        static bool getlength(const char *& p, const char *end, size_t& n)
+        {
+            n = 0;
+            for (int shift = 0; p < end && shift < 64; shift += 7)
+            {
+                unsigned char c = *p++;
+                n |= (size_t)(c & 0x7f) << shift;
+                if ((c & 0x80) == 0)
+                    return true;
+            }
+            return false;
+        }
+
+        void encode(std::string& out, char op, const std::string& key, const T *pValue);
+        bool append(char op, const std::string& key, const T *pValue);
+        bool replay(const char *p, const char *end, bool bCheckpoint);
+        bool readfile(const std::string& name, std::vector<char>& data);
+    };
+
+    template<typename T, typename Traits, typename Codec>
+    void stringtrie_log<T, Traits, Codec>::encode(std::string& out, char op, const std::string& key, const T *pValue)
+    {
+        size_t start = out.size();
+        out += op;
+        putlength(out, key.size());
+        out += key;
+        if (pValue)
+        {
+            scratch.clear();
+            Codec::encode(*pValue, scratch);
+            putlength(out, scratch.size());
+            out += scratch;
+        }
+        unsigned int h = hash(out.data() + start, out.size() - start);
+        for (int i = 0; i < 4; ++i)
+            out += (char)(h >> (i * 8));
+    }
+
+    template<typename T, typename Traits, typename Codec>
+    bool stringtrie_log<T, Traits, Codec>::append(char op, const std::string& key, const T *pValue)
+    {
+        encode(batch, op, key, pValue);
+        if (batch.size() < batchbytes)
+            return true;
+        if (commit() == false)
+            return false;
+        if (logbytes >= checkpointbytes)
+            return checkpoint();
+        return true;
+    }
+
+    template<typename T, typename Traits, typename Codec>
+    bool stringtrie_log<T, Traits, Codec>::commit()
+    {
+        if (batch.empty() || NULL == fp)
+            return fp != NULL;
+        if (fwrite(batch.data(), 1, batch.size(), fp) != batch.size())
+            return false;
+        logbytes += batch.size();
+        batch.clear();
+        return stringtrie_sync(fp);
+    }
+
+    template<typename T, typename Traits, typename Codec>
+    bool stringtrie_log<T, Traits, Codec>::close()
+    {
+        if (NULL == fp)
+            return true;
+        bool bOk = commit();
+        fclose(fp);
+        fp = NULL;
+        return bOk;
+    }
+
+    template<typename T, typename Traits, typename Codec>
+    bool stringtrie_log<T, Traits, Codec>::checkpoint()
+    {
+        if (commit() == false)
+            return false;
+
+        // Everything logged so far is in the snapshot, the new log holds what comes after
+        typename trie_type::snapshot_type snap = trie.snapshot();
+        FILE *fpNew = fopen(logname(lognum + 1).c_str(), "wb");
+        if (NULL == fpNew)
+            return false;
+        if (stringtrie_syncdir(path) == false)
+        {
+            fclose(fpNew);
+            return false;
+        }
+        fclose(fp);
+        fp = fpNew;
+        ++lognum;
+        logbytes = 0;
+
+        std::string tmpname = checkpointname() + ".tmp";
+        FILE *fpCheckpoint = fopen(tmpname.c_str(), "wb");
+        if (NULL == fpCheckpoint)
+            return false;
+        std::string out;
+        char header[48];
+        int headerlen = snprintf(header, sizeof(header), "STCK %u %lu\n", lognum, (unsigned long)snap.size());
+        if (headerlen < 0 || headerlen >= (int)sizeof(header))
+        {
+            fclose(fpCheckpoint);
+            return false;
+        }
+        out = header;
+        bool bOk = true;
+        for (typename trie_type::snapshot_type::const_iterator it = snap.begin(); it != snap.end() && bOk; ++it)
+        {
+            encode(out, 'I', (*it).first, &(*it).second);
+            if (out.size() >= WRITE_CHUNK)
+            {
+                bOk = fwrite(out.data(), 1, out.size(), fpCheckpoint) == out.size();
+                out.clear();
+            }
+        }
+        if (bOk)
+            bOk = fwrite(out.data(), 1, out.size(), fpCheckpoint) == out.size();
+        if (bOk)
+            bOk = stringtrie_sync(fpCheckpoint);
+        fclose(fpCheckpoint);
+        if (bOk == false)
+            return false;
+
+#ifdef _WIN32
+        // rename() does not replace an existing file on Windows
+        remove(checkpointname().c_str());
+#endif
+        if (rename(tmpname.c_str(), checkpointname().c_str()) != 0 || stringtrie_syncdir(path) == false)
+            return false;
+        for (; firstlog < lognum; ++firstlog)
+            remove(logname(firstlog).c_str());
+        return true;
+    }
+
+    template<typename T, typename Traits, typename Codec>
+    bool stringtrie_log<T, Traits, Codec>::readfile(const std::string& name, std::vector<char>& data)
+    {
+        data.clear();
+        FILE *fpRead = fopen(name.c_str(), "rb");
+        if (NULL == fpRead)
+            return false;
+        char buf[64 * 1024];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fpRead)) > 0)
+            data.insert(data.end(), buf, buf + n);
+        fclose(fpRead);
+        return true;
+    }
+
+    // Apply the records between p and end, returns false if the last one is damaged
+    template<typename T, typename Traits, typename Codec>
+    bool stringtrie_log<T, Traits, Codec>::replay(const char *p, const char *end, bool bCheckpoint)
+    {
+        while (p < end)
+        {
+            const char *start = p;
+            char op = *p++;
+            size_t keylen;
+            if (getlength(p, end, keylen) == false || (size_t)(end - p) < keylen)
+                return false;
+            const char *key = p;
+            p += keylen;
+            const char *value = NULL;
+            size_t valuelen = 0;
+            if (op != 'E')
+            {
+                if (getlength(p, end, valuelen) == false || (size_t)(end - p) < valuelen)
+                    return false;
+                value = p;
+                p += valuelen;
+            }
+            if (end - p < 4)
+                return false;
+            unsigned int h = 0;
+            for (int i = 0; i < 4; ++i)
+                h |= (unsigned int)(unsigned char)p[i] << (i * 8);
+            if (h != hash(start, p - start))
+                return false;
+            p += 4;
+
+            T v;
+            if (value && Codec::decode(value, valuelen, v) == false)
+                return false;
+            if (op == 'I')
+            {
+                trie.insert(key, keylen, v);
+            }
+            else if (op == 'A' && bCheckpoint == false)
+            {
+                iterator it = trie.find(key, keylen);
+                if (it == trie.end())
+                    trie.insert(key, keylen, v);
+                else
+                    it.value() = v;
+            }
+            else if (op == 'E' && bCheckpoint == false)
+            {
+                trie.erase(std::string(key, keylen));
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template<typename T, typename Traits, typename Codec>
+    bool stringtrie_log<T, Traits, Codec>::open()
+    {
+        close();
+        lognum = 0;
+        std::vector<char> data;
+        if (readfile(checkpointname(), data))
+        {
+            const char *p = data.empty() ? NULL : &data[0];
+            const char *end = p + data.size();
+            const char *eol = p ? (const char *)memchr(p, '\n', data.size()) : NULL;
+            unsigned long n = 0;
+            if (NULL == eol || sscanf(p, "STCK %u %lu", &lognum, &n) != 2)
+                return false;
+            // A checkpoint is renamed into place only once it is complete
+            if (replay(eol + 1, end, true) == false)
+                return false;
+
+            // The logs before the checkpoint are deleted after it is renamed into place,
+            // a crash in between leaves them behind. They are deleted oldest first, so
+            // the ones left end just below the checkpoint's log.
+            for (unsigned int n = lognum; n > 0; --n)
+            {
+                if (remove(logname(n - 1).c_str()) != 0)
+                    break;
+            }
+        }
+        firstlog = lognum;
+
+        bool bDamaged = false;
+        for (unsigned int n = lognum; readfile(logname(n), data); ++n)
+        {
+            lognum = n;
+            if (data.empty() == false && replay(&data[0], &data[0] + data.size(), false) == false)
+            {
+                bDamaged = true;
+                break;
+            }
+        }
+
+        fp = fopen(logname(lognum).c_str(), "ab");
+        if (NULL == fp || stringtrie_syncdir(path) == false)
+            return false;
+        fseek(fp, 0, SEEK_END);
+        logbytes = ftell(fp);
+        if (bDamaged)
+            return checkpoint();
+        return true;
+    }
+}   // namespace tt_coreutils_ns
+#endif
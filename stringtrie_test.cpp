@@ -7,9 +7,13 @@
 #include <iostream>
 #include <algorithm>
 #include <map>
+#include <set>
 #include <unordered_map>
 #include <fstream>
 #include "stringtrie.h"
+#include "stringtrie_loader.h"
+#include "stringtrie_log.h"
+#include "static_stringtrie.h"
 
 using namespace std;
 
@@ -63,18 +67,7 @@ void loadPTable(unordered_map<string, int>& m)
 
 void loadPTable(stringtrie<int>& trie)
 {
-    ifstream strm;
-    strm.open("test_TTProdTbl_CME-D_SIM .dat");
-    while (strm.good())
-    {
-        char buf[255];
-        strm.getline(buf, sizeof(buf), ';');
-        if (strm.good())
-        {
-            trie.insert(stringtrie<int>::value_type(buf, 0));
-        }
-        strm.getline(buf, sizeof(buf), '\n');
-    }
+    stringtrie_load("test_TTProdTbl_CME-D_SIM .dat", trie);
 }
 
 void query(stringtrie<int>& tree)
@@ -95,6 +88,18 @@ void query(stringtrie<int>& tree)
     }
 }
 
+// A short random key over a small alphabet, so keys share prefixes often
+string randomkey(int maxlen = 5)
+{
+    string key;
+    int len = 1 + rand() % maxlen;
+    for (int i = 0; i < len; ++i)
+    {
+        key += "ABCEZ"[rand() % 5];
+    }
+    return key;
+}
+
 class BasicTest
 {
 public:
@@ -115,6 +120,11 @@ public:
         erase("hello");
     }
 
+    void erase(stringtrie<int>::iterator it)
+    {
+        erase((*it).first);
+    }
+
     void erase(const string& key)
     {
         auto it = find(keys.begin(), keys.end(), key);
@@ -158,175 +168,2366 @@ public:
     vector<string> keys;
 };
 
-
-enum
+// Compares the ordered navigation of the trie against std::map
+class OrderedTest
 {
-    TEST_ITERATIONS = 1000000
-};
+public:
+    void test()
+    {
+        srand(2);
+        for (int i = 0; i < 2000; ++i)
+        {
+            string key = randomkey(6);
+            m[key] = i;
+            tree[key] = i;
+        }
+        assert(tree.size() == m.size());
 
-void testMap(vector<string>& data)
-{
-    map<string, int> m;
+        // Forward and reverse iteration
+        map<string, int>::iterator mit = m.begin();
+        for (stringtrie<int>::iterator it = tree.begin(); it != tree.end(); ++it, ++mit)
+        {
+            assert((*it).first == mit->first);
+        }
+        assert(mit == m.end());
+        map<string, int>::reverse_iterator rmit = m.rbegin();
+        for (stringtrie<int>::reverse_iterator it = tree.rbegin(); it != tree.rend(); ++it, ++rmit)
+        {
+            assert((*it).first == rmit->first);
+            // base() is one past the element, as for std::reverse_iterator
+            stringtrie<int>::iterator fwd = it.base();
+            --fwd;
+            assert((*fwd).first == (*it).first);
+        }
+        assert(rmit == m.rend());
+        assert(tree.rbegin().base() == tree.end() && tree.rend().base() == tree.begin());
+        stringtrie<int>::iterator last = tree.end();
+        --last;
+        assert((*last).first == m.rbegin()->first);
 
-    LARGE_INTEGER loadStart;
-    LARGE_INTEGER loadStop;
-    LARGE_INTEGER runStart;
-    LARGE_INTEGER runStop;
-    QueryPerformanceCounter(&loadStart);
-    loadPTable(m);
-    QueryPerformanceCounter(&loadStop);
+        for (int i = 0; i < 5000; ++i)
+        {
+            string key = randomkey(6);
+            check(tree.lower_bound(key), m.lower_bound(key));
+            check(tree.upper_bound(key), m.upper_bound(key));
+            check(tree.successor(key), m.upper_bound(key));
 
-    _int64 loadTime = loadStop.QuadPart - loadStart.QuadPart;
-    srand(1);
-    int n = data.size();
-    QueryPerformanceCounter(&runStart);
-    for (int i = 0; i < TEST_ITERATIONS; ++i)
-    {
-        int idx = rand() % n;
-        auto it = m.find(data[idx]);
-        assert(it != m.end());
+            pair<stringtrie<int>::iterator, stringtrie<int>::iterator> r = tree.equal_range(key);
+            size_t n = 0;
+            for (; r.first != r.second; ++r.first)
+                ++n;
+            assert(n == m.count(key));
+
+            stringtrie<int>::iterator it = tree.predecessor(key);
+            map<string, int>::iterator mp = m.lower_bound(key);
+            if (mp == m.begin())
+            {
+                assert(it == tree.end());
+            }
+            else
+            {
+                --mp;
+                assert((*it).first == mp->first);
+            }
+        }
+        check(tree.lower_bound(""), m.lower_bound(""));
+        check(tree.upper_bound("~"), m.upper_bound("~"));
+
+        stringtrie<int> empty;
+        assert(empty.begin() == empty.end());
+        assert(empty.rbegin() == empty.rend());
+        assert(empty.lower_bound("a") == empty.end());
     }
-    QueryPerformanceCounter(&runStop);
-    _int64 runTime = runStop.QuadPart - runStart.QuadPart;
 
-    LARGE_INTEGER freq;
-    QueryPerformanceFrequency(&freq);
-    double load = (double)loadTime/(double)freq.QuadPart;
-    double run = (double)runTime/(double)freq.QuadPart;
-    cout << "map: LoadTime: " << load << " secs, runTime: " << run << " secs" << endl;
-    cout << "avg find: " << (run/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
-    cout << "avg load: " << (load/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+    void check(stringtrie<int>::iterator it, map<string, int>::iterator mit)
+    {
+        if (mit == m.end())
+        {
+            assert(it == tree.end());
+        }
+        else
+        {
+            assert(it != tree.end());
+            assert((*it).first == mit->first);
+        }
+    }
 
-}
+    stringtrie<int> tree;
+    map<string, int> m;
+};
 
-void testUnorderedMap(vector<string>& data)
+// Checks the subtree counts against std::map while keys are added and removed
+class CountTest
 {
-    unordered_map<string, int> m;
-
-    LARGE_INTEGER loadStart;
-    LARGE_INTEGER loadStop;
-    LARGE_INTEGER runStart;
-    LARGE_INTEGER runStop;
-    QueryPerformanceCounter(&loadStart);
-    loadPTable(m);
-    QueryPerformanceCounter(&loadStop);
+public:
+    typedef stringtrie<int, stringtrie_counted_traits> trie_type;
 
-    _int64 loadTime = loadStop.QuadPart - loadStart.QuadPart;
-    srand(1);
-    int n = data.size();
-    QueryPerformanceCounter(&runStart);
-    for (int i = 0; i < TEST_ITERATIONS; ++i)
+    void test()
     {
-        int idx = rand() % n;
-        auto it = m.find(data[idx]);
-        assert(it != m.end());
+        srand(3);
+        for (int i = 0; i < 3000; ++i)
+        {
+            string key = randomkey();
+            if (rand() % 3 == 0)
+            {
+                m.erase(key);
+                tree.erase(key);
+            }
+            else
+            {
+                m[key] = i;
+                tree[key] = i;
+            }
+        }
+        assert(tree.size() == m.size());
+
+        for (int i = 0; i < 2000; ++i)
+        {
+            string key = randomkey();
+            map<string, int>::iterator lb = m.lower_bound(key);
+            size_t r = 0;
+            for (map<string, int>::iterator it = m.begin(); it != lb; ++it)
+                ++r;
+            assert(tree.rank(key) == r);
+
+            string prefix = key.substr(0, 1 + rand() % key.length());
+            size_t n = 0;
+            for (map<string, int>::iterator it = m.lower_bound(prefix); it != m.end() && it->first.compare(0, prefix.length(), prefix) == 0; ++it)
+            {
+                trie_type::iterator nit = tree.nth_with_prefix(prefix, n);
+                assert(nit != tree.end() && (*nit).first == it->first);
+                ++n;
+            }
+            assert(tree.count_prefix(prefix) == n);
+            assert(tree.nth_with_prefix(prefix, n) == tree.end());
+        }
+
+        size_t n = 0;
+        for (map<string, int>::iterator it = m.begin(); it != m.end(); ++it, ++n)
+        {
+            assert((*tree.nth(n)).first == it->first);
+        }
+        assert(tree.nth(n) == tree.end());
+        assert(tree.count_prefix("") == m.size());
     }
-    QueryPerformanceCounter(&runStop);
-    _int64 runTime = runStop.QuadPart - runStart.QuadPart;
 
-    LARGE_INTEGER freq;
-    QueryPerformanceFrequency(&freq);
-    double load = (double)loadTime/(double)freq.QuadPart;
-    double run = (double)runTime/(double)freq.QuadPart;
-    cout << "unordered_map: LoadTime: " << load << " secs, runTime: " << run << " secs" << endl;
-    cout << "avg find: " << (run/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
-    cout << "avg load: " << (load/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
-}
+    trie_type tree;
+    map<string, int> m;
+};
 
-void testTrie(vector<string>& data)
+// Snapshots must not see changes made to the trie after they were taken
+class SnapshotTest
 {
-    stringtrie<int> tree;
+public:
+    typedef stringtrie<int, stringtrie_counted_traits> trie_type;
 
-    LARGE_INTEGER loadStart;
-    LARGE_INTEGER loadStop;
-    LARGE_INTEGER runStart;
-    LARGE_INTEGER runStop;
-    QueryPerformanceCounter(&loadStart);
-    loadPTable(tree);
-    QueryPerformanceCounter(&loadStop);
+    void test()
+    {
+        srand(4);
+        trie_type tree;
+        map<string, int> m;
+        vector<trie_type::snapshot_type> snaps;
+        vector<map<string, int> > expected;
+        for (int round = 0; round < 20; ++round)
+        {
+            for (int i = 0; i < 200; ++i)
+            {
+                string key = randomkey();
+                switch (rand() % 3)
+                {
+                case 0:
+                    tree.erase(key);
+                    m.erase(key);
+                    break;
+                case 1:
+                    tree[key] = i;
+                    m[key] = i;
+                    break;
+                default:
+                    tree.insert(trie_type::value_type(key, i));
+                    m.insert(map<string, int>::value_type(key, i));
+                    break;
+                }
+            }
+            snaps.push_back(tree.snapshot());
+            expected.push_back(m);
+            if (round % 4 == 3)
+            {
+                // Release an older snapshot while the newer ones are still in use
+                snaps.erase(snaps.begin());
+                expected.erase(expected.begin());
+            }
+            for (size_t i = 0; i < snaps.size(); ++i)
+            {
+                check(snaps[i], expected[i]);
+            }
+            check(tree, m);
+        }
 
-    _int64 loadTime = loadStop.QuadPart - loadStart.QuadPart;
+        // Reading through iterators does not copy the nodes shared with a snapshot, so a
+        // dereferenced iterator still equals its copies and can end a range to erase
+        {
+            map<string, int> before = m;
+            trie_type::snapshot_type shared = tree.snapshot();
+            trie_type::iterator first = tree.begin();
+            trie_type::iterator last = first;
+            for (int i = 0; i < 10 && last != tree.end(); ++i)
+            {
+                trie_type::iterator kept = last;
+                assert(m[(*last).first] == (*last).second);
+                assert(kept == last);
+                ++last;
+            }
+            if (last != tree.end())
+            {
+                trie_type::iterator kept = last;
+                m.erase(m.begin(), m.find((*last).first));
+                assert(kept == last);
+            }
+            else
+            {
+                m.clear();
+            }
+            tree.erase(first, last);
+            check(tree, m);
+            check(shared, before);
+        }
 
-    srand(1);
-    int n = data.size();
-    QueryPerformanceCounter(&runStart);
-    for (int i = 0; i < TEST_ITERATIONS; ++i)
-    {
-        int idx = rand() % n;
-        stringtrie<int>::iterator it = tree.find(data[idx]);
-        assert((*it).second != false);
+        // Values changed through an iterator are not seen by the snapshot
+        trie_type::snapshot_type snap = tree.snapshot();
+        for (trie_type::iterator it = tree.begin(); it != tree.end(); ++it)
+        {
+            it.value() = -1;
+        }
+        check(snap, m);
+        for (trie_type::snapshot_type::const_iterator it = snap.begin(); it != snap.end(); ++it)
+        {
+            assert((*tree.find((*it).first)).second == -1);
+            assert((*it).second != -1);
+        }
+        assert(tree.count_prefix("") == m.size());
+
+        // Copies do not share with the original
+        trie_type copy(tree);
+        copy.clear();
+        assert(copy.empty() && tree.size() == m.size());
+        copy = tree;
+        assert(copy.size() == tree.size());
     }
-    QueryPerformanceCounter(&runStop);
 
-    _int64 runTime = runStop.QuadPart - runStart.QuadPart;
-    LARGE_INTEGER freq;
-    QueryPerformanceFrequency(&freq);
-    double load = (double)loadTime/(double)freq.QuadPart;
-    double run = (double)runTime/(double)freq.QuadPart;
-    cout << "trie: LoadTime: " << load << " secs, runTime: " << run << " secs" << endl;
-    cout << "avg find: " << (run/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
-    cout << "avg load: " << (load/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+    void check(trie_type& tree, map<string, int>& m)
+    {
+        assert(tree.size() == m.size());
+        for (map<string, int>::iterator it = m.begin(); it != m.end(); ++it)
+        {
+            assert((*tree.find(it->first)).second == it->second);
+        }
+    }
 
-    cout << "size: " << tree.size() << ", Num nodes: " << tree.getnumnodes() << ", mem: " << tree.getmemusage() << ", mem/node: " << tree.getmemusage()/tree.size() << endl;
-}
+    void check(const trie_type::snapshot_type& snap, const map<string, int>& m)
+    {
+        assert(snap.size() == m.size());
+        map<string, int>::const_iterator mit = m.begin();
+        for (trie_type::snapshot_type::const_iterator it = snap.begin(); it != snap.end(); ++it, ++mit)
+        {
+            assert((*it).first == mit->first && (*it).second == mit->second);
+            assert(*snap.find(mit->first) == mit->second);
+        }
+        assert(mit == m.end());
+    }
+};
 
-class DataCompare
+// Compares merge() and the set operations with the std::map equivalents
+class SetTest
 {
 public:
-    bool operator()(const pair<string, int>& p1, const pair<string, int>& p2)
+    typedef stringtrie<int, stringtrie_counted_traits> trie_type;
+
+    static int sum(const int& a, const int& b)
     {
-        return p1.first < p2.first;
+        return a + b;
     }
 
-    bool operator()(const pair<string, int>& p1, const string& s)
+    void test()
     {
-        return p1.first < s;
+        srand(5);
+        for (int round = 0; round < 50; ++round)
+        {
+            trie_type a, b;
+            map<string, int> ma, mb;
+            fill(a, ma, rand() % 300);
+            fill(b, mb, rand() % 300);
+
+            trie_type result;
+            map<string, int> expected;
+
+            expected = ma;
+            for (map<string, int>::iterator it = mb.begin(); it != mb.end(); ++it)
+                expected[it->first] += it->second;
+            set_union(a, b, result, sum);
+            check(result, expected);
+
+            expected.clear();
+            for (map<string, int>::iterator it = ma.begin(); it != ma.end(); ++it)
+            {
+                if (mb.count(it->first))
+                    expected[it->first] = it->second + mb[it->first];
+            }
+            set_intersection(a, b, result, sum);
+            check(result, expected);
+
+            expected.clear();
+            for (map<string, int>::iterator it = ma.begin(); it != ma.end(); ++it)
+            {
+                if (mb.count(it->first) == 0)
+                    expected[it->first] = it->second;
+            }
+            set_difference(a, b, result);
+            check(result, expected);
+
+            // Merge while a snapshot of b holds its nodes, then change the merged 
+            // keys. The snapshot must not see any of it.
+            trie_type::snapshot_type snap = b.snapshot();
+            expected = ma;
+            expected.insert(mb.begin(), mb.end());
+            a.merge(b);
+            assert(b.empty());
+            check(a, expected);
+            for (map<string, int>::iterator it = expected.begin(); it != expected.end(); ++it)
+            {
+                a[it->first] = -1;
+                if (rand() % 2)
+                    a.erase(it->first);
+            }
+            assert(snap.size() == mb.size());
+            for (map<string, int>::iterator it = mb.begin(); it != mb.end(); ++it)
+            {
+                assert(*snap.find(it->first) == it->second);
+            }
+        }
     }
 
-    bool operator()(const string& s, const pair<string, int>& p1)
+    void fill(trie_type& tree, map<string, int>& m, int n)
     {
-        return s < p1.first;
+        for (int i = 0; i < n; ++i)
+        {
+            string key = randomkey(6);
+            tree[key] = i;
+            m[key] = i;
+        }
+    }
+
+    void check(trie_type& tree, map<string, int>& m)
+    {
+        assert(tree.size() == m.size());
+        assert(tree.count_prefix("") == m.size());
+        map<string, int>::iterator mit = m.begin();
+        for (trie_type::iterator it = tree.begin(); it != tree.end(); ++it, ++mit)
+        {
+            assert((*it).first == mit->first && (*it).second == mit->second);
+        }
+        assert(mit == m.end());
+        int nodes = tree.getnumnodes();
+        trie_type copy;
+        for (mit = m.begin(); mit != m.end(); ++mit)
+            copy.insert(trie_type::value_type(mit->first, mit->second));
+        assert(nodes >= copy.getnumnodes());
     }
 };
 
-void testSortedVector(vector<string>& data)
+// The value is the number in the second field
+struct SecondField
 {
-    vector<std::pair<std::string, int> > m;
-    
-    LARGE_INTEGER loadStart;
-    LARGE_INTEGER loadStop;
-    LARGE_INTEGER runStart;
-    LARGE_INTEGER runStop;
-    QueryPerformanceCounter(&loadStart);
-    for each(const string &s in data)
+    int operator()(const char *, size_t, const char *fields, size_t len) const
     {
-        m.push_back(pair<string, int>(s, 0));
+        int n = 0;
+        for (size_t i = 0; i < len && fields[i] >= '0' && fields[i] <= '9'; ++i)
+            n = n * 10 + fields[i] - '0';
+        return n;
     }
+};
 
-    sort(m.begin(), m.end(), DataCompare());
-    QueryPerformanceCounter(&loadStop);
+// Loads a file that spans several chunks, with long keys, a line longer than a
+// chunk, CRLF line ends and no line end on the last line
+class LoaderTest
+{
+public:
+    void test()
+    {
+        const char *filename = "stringtrie_loader_test.dat";
+        map<string, int> m;
+        FILE *fp = fopen(filename, "wb");
+        assert(fp);
+        srand(6);
+        for (int i = 0; i < 100000; ++i)
+        {
+            string key = randomletters(i == 500 ? 1000 : 20);
+            fprintf(fp, "%s;%d;CME;Future\r\n", key.c_str(), i);
+            m.insert(map<string, int>::value_type(key, i));
+            if (i == 500)
+            {
+                // Not 7 bit text, skipped
+                fprintf(fp, "A\xC1Z;5;CME;Future\n");
+            }
+            if (i == 70000)
+            {
+                string fields(LOAD_CHUNK + 100, 'x');
+                fprintf(fp, "long;7;%s\n", fields.c_str());
+                m.insert(map<string, int>::value_type("long", 7));
+            }
+        }
+        fprintf(fp, "last;99");
+        m.insert(map<string, int>::value_type("last", 99));
+        fclose(fp);
 
-    _int64 loadTime = loadStop.QuadPart - loadStart.QuadPart;
+        stringtrie<int> tree;
+        stringtrie_loadstats stats;
+        bool bOk = stringtrie_load(filename, tree, SecondField(), ';', '\n', &stats);
+        remove(filename);
+        assert(bOk);
+        assert(stats.lines == 100003 && stats.keys == m.size() && stats.rejected == 1);
+        assert(tree.size() == m.size());
+        for (map<string, int>::iterator it = m.begin(); it != m.end(); ++it)
+        {
+            stringtrie<int>::iterator tit = tree.find(it->first);
+            assert(tit != tree.end() && (*tit).second == it->second);
+        }
+        assert(stringtrie_load("no such file", tree) == false);
 
-    srand(1);
-    int n = data.size();
-    QueryPerformanceCounter(&runStart);
-    for (int i = 0; i < TEST_ITERATIONS; ++i)
-    {
-        int idx = rand() % n;
-        vector<std::pair<std::string, int> >::iterator it = lower_bound(m.begin(), m.end(), data[idx], DataCompare());
-        assert(it != m.end());
+        // A byte above 0x7f has no slot in a text trie, it must not stand in for the
+        // ASCII character in the slot it would wrap around to
+        stringtrie<int> text;
+        assert(text.insert(stringtrie<int>::value_type("Ax", 1)).second);
+        assert(text.insert(stringtrie<int>::value_type("\xC1y", 2)).second == false);
+        assert(text.insert(stringtrie<int>::value_type("B", 3)).second);
+        assert(text.size() == 2 && text.find("\xC1y") == text.end() && text.find("Ax") != text.end());
+        assert(text.lower_bound("A\xC1") == text.find("B") && text.lower_bound("\xC1") == text.end());
+        assert(text.count("\xC1y") == 0 && text.erase("\xC1y") == 0);
+        int n = 0;
+        for (stringtrie<int>::iterator it = text.begin(); it != text.end(); ++it)
+            ++n;
+        assert(n == 2);
+    }
+
+    string randomletters(int len)
+    {
+        string key;
+        for (int i = 0; i < len; ++i)
+        {
+            key += 'A' + rand() % 26;
+        }
+        return key;
+    }
+};
+
+// Changes made through the log must come back after a restart, including when
+// the last record was only partly written
+class LogTest
+{
+public:
+    void test()
+    {
+        const char *path = "stringtrie_log_test";
+        cleanup(path);
+        map<string, int> m;
+        srand(7);
+        for (int restart = 0; restart < 6; ++restart)
+        {
+            string stale;
+            if (restart == 3)
+            {
+                // A crash after a checkpoint was renamed into place but before the logs
+                // it replaced were deleted
+                int first = firstlog(path);
+                assert(first > 0);
+                stale = logname(path, first - 1);
+                FILE *fp = fopen(stale.c_str(), "wb");
+                fwrite("E\x01A", 1, 3, fp);
+                fclose(fp);
+            }
+
+            stringtrie<int> tree;
+            stringtrie_log<int> log(tree, path);
+            bool bOk = log.open();
+            assert(bOk);
+            check(tree, m);
+            if (stale.empty() == false)
+            {
+                FILE *fp = fopen(stale.c_str(), "rb");
+                if (fp)
+                    fclose(fp);
+                assert(NULL == fp);
+            }
+
+            log.setbatchbytes(1 + rand() % 2000);
+            log.setcheckpointbytes(20000);
+            for (int i = 0; i < 3000; ++i)
+            {
+                string key = randomkey();
+                switch (rand() % 3)
+                {
+                case 0:
+                    assert(log.erase(key) == m.erase(key));
+                    break;
+                case 1:
+                    log.assign(key, i);
+                    m[key] = i;
+                    break;
+                default:
+                    assert(log.insert(stringtrie<int>::value_type(key, i)).second == m.insert(map<string, int>::value_type(key, i)).second);
+                    break;
+                }
+            }
+            if (restart == 2)
+                log.checkpoint();
+            log.close();
+
+            if (restart == 4)
+            {
+                // A crash part way through writing a record
+                FILE *fp = fopen(lastlog(path).c_str(), "ab");
+                fwrite("I\x05ZZZZZ\x04", 1, 8, fp);
+                fclose(fp);
+            }
+        }
+        stringtrie<int> tree;
+        stringtrie_log<int> log(tree, path);
+        assert(log.open());
+        check(tree, m);
+        log.close();
+        cleanup(path);
+    }
+
+    string logname(const char *path, int n)
+    {
+        char buf[64];
+        sprintf(buf, "%s.%d.log", path, n);
+        return buf;
+    }
+
+    string lastlog(const char *path)
+    {
+        string last;
+        for (int n = 0; n < 1000; ++n)
+        {
+            FILE *fp = fopen(logname(path, n).c_str(), "rb");
+            if (fp)
+            {
+                fclose(fp);
+                last = logname(path, n);
+            }
+        }
+        return last;
+    }
+
+    // The number of the oldest log, or -1
+    int firstlog(const char *path)
+    {
+        for (int n = 0; n < 1000; ++n)
+        {
+            FILE *fp = fopen(logname(path, n).c_str(), "rb");
+            if (fp)
+            {
+                fclose(fp);
+                return n;
+            }
+        }
+        return -1;
+    }
+
+    void cleanup(const char *path)
+    {
+        for (int n = 0; n < 1000; ++n)
+        {
+            char buf[64];
+            sprintf(buf, "%s.%d.log", path, n);
+            remove(buf);
+        }
+        remove((string(path) + ".ckpt").c_str());
+    }
+
+    void check(stringtrie<int>& tree, map<string, int>& m)
+    {
+        assert(tree.size() == m.size());
+        for (map<string, int>::iterator it = m.begin(); it != m.end(); ++it)
+        {
+            stringtrie<int>::iterator tit = tree.find(it->first);
+            assert(tit != tree.end() && (*tit).second == it->second);
+        }
+    }
+};
+
+// erase_prefix() and erase(first, last) must leave the same trie as erasing the
+// keys one at a time, and must not change a snapshot
+class BulkEraseTest
+{
+public:
+    typedef stringtrie<int, stringtrie_counted_traits> trie_type;
+
+    void test()
+    {
+        srand(13);
+        for (int round = 0; round < 200; ++round)
+        {
+            trie_type bulk;
+            trie_type single;
+            map<string, int> m;
+            for (int i = 0; i < 300; ++i)
+            {
+                string key = randomkey();
+                bulk[key] = i;
+                single[key] = i;
+                m[key] = i;
+            }
+            trie_type::snapshot_type snap;
+            map<string, int> before;
+            if (round % 3 == 0)
+            {
+                snap = bulk.snapshot();
+                before = m;
+            }
+
+            if (round % 2)
+            {
+                string prefix = randomkey().substr(0, 1 + rand() % 3);
+                size_t n = 0;
+                while (m.lower_bound(prefix) != m.end() && m.lower_bound(prefix)->first.compare(0, prefix.size(), prefix) == 0)
+                {
+                    single.erase(m.lower_bound(prefix)->first);
+                    m.erase(m.lower_bound(prefix));
+                    ++n;
+                }
+                assert(bulk.erase_prefix(prefix) == n);
+            }
+            else
+            {
+                string from = randomkey();
+                string to = randomkey();
+                if (to < from)
+                    swap(from, to);
+                map<string, int>::iterator last = (rand() % 4) ? m.lower_bound(to) : m.end();
+                for (map<string, int>::iterator it = m.lower_bound(from); it != last; )
+                {
+                    single.erase(it->first);
+                    m.erase(it++);
+                }
+                bulk.erase(bulk.lower_bound(from), last == m.end() ? bulk.end() : bulk.lower_bound(to));
+            }
+
+            assert(bulk.size() == m.size());
+            assert(bulk.getnumnodes() == single.getnumnodes());
+            assert(bulk.count_prefix("") == m.size());
+            for (map<string, int>::iterator it = m.begin(); it != m.end(); ++it)
+            {
+                trie_type::iterator tit = bulk.find(it->first);
+                assert(tit != bulk.end() && (*tit).second == it->second);
+                assert(bulk.count_prefix(it->first.substr(0, 1)) == single.count_prefix(it->first.substr(0, 1)));
+            }
+            size_t n = 0;
+            for (trie_type::iterator it = bulk.begin(); it != bulk.end(); ++it)
+                ++n;
+            assert(n == m.size());
+
+            assert(snap.size() == before.size());
+            for (map<string, int>::iterator it = before.begin(); it != before.end(); ++it)
+                assert(snap.count(it->first) == 1);
+        }
+    }
+};
+
+// Integer, binary and tuple keys must find, order and erase like a map of the same keys
+class KeyTest
+{
+public:
+    template<typename Key, typename Make>
+    void testkeys(Make make)
+    {
+        typedef stringtrie<int, stringtrie_keyed_traits<Key, stringtrie_counted_traits> > trie_type;
+        trie_type tree;
+        map<Key, int> m;
+        for (int i = 0; i < 3000; ++i)
+        {
+            Key key = make();
+            if (rand() % 4 == 0)
+            {
+                assert(tree.erase(key) == m.erase(key));
+            }
+            else
+            {
+                tree[key] = i;
+                m[key] = i;
+            }
+        }
+        assert(tree.size() == m.size());
+
+        typename map<Key, int>::iterator mit = m.begin();
+        for (typename trie_type::iterator it = tree.begin(); it != tree.end(); ++it, ++mit)
+        {
+            assert((*it).first == mit->first && (*it).second == mit->second);
+        }
+        assert(mit == m.end());
+
+        for (int i = 0; i < 1000; ++i)
+        {
+            Key key = make();
+            typename trie_type::iterator it = tree.find(key);
+            assert((it == tree.end()) == (m.find(key) == m.end()));
+            typename map<Key, int>::iterator lb = m.lower_bound(key);
+            typename trie_type::iterator tlb = tree.lower_bound(key);
+            assert((lb == m.end()) == (tlb == tree.end()));
+            if (lb != m.end())
+                assert((*tlb).first == lb->first);
+            size_t r = 0;
+            for (typename map<Key, int>::iterator it2 = m.begin(); it2 != lb; ++it2)
+                ++r;
+            assert(tree.rank(key) == r);
+        }
+    }
+
+    void test()
+    {
+        srand(17);
+        testkeys<unsigned long long>(makeu64);
+        testkeys<int>(makeint);
+        testkeys<basic_string<unsigned char> >(makebinary);
+        testkeys<pair<unsigned int, unsigned short> >(makepair);
+    }
+
+    // Small ranges so keys repeat, with bytes above 127 and negative numbers
+    static unsigned long long makeu64()
+    {
+        return ((unsigned long long)(rand() % 4) << 62) | ((unsigned long long)(rand() % 8) << 24) | (rand() % 300);
+    }
+
+    static int makeint()
+    {
+        return (rand() % 2000 - 1000) * ((rand() % 2) ? 1 : 65537);
+    }
+
+    static basic_string<unsigned char> makebinary()
+    {
+        basic_string<unsigned char> key;
+        int len = 1 + rand() % 3;
+        for (int i = 0; i < len; ++i)
+            key += (unsigned char)("\x00\x01\x7f\x80\xff"[rand() % 5]);
+        return key;
+    }
+
+    static pair<unsigned int, unsigned short> makepair()
+    {
+        return pair<unsigned int, unsigned short>(0x0a000000 + rand() % 50 * 0x01010101, 80 + rand() % 3 * 0x100);
+    }
+};
+
+// relayout() must keep every key, in slices with changes and snapshots in between
+class RelayoutTest
+{
+public:
+    typedef stringtrie<int, stringtrie_counted_traits> trie_type;
+
+    void test()
+    {
+        srand(19);
+        vector<trie_type::snapshot_type> snaps;
+        vector<size_t> snapsizes;
+        for (int i = 0; i < 20000; ++i)
+        {
+            string key = randomkey();
+            switch (rand() % 8)
+            {
+            case 0:
+            case 1:
+                m.erase(key);
+                tree.erase(key);
+                break;
+            case 2:
+                tree.relayout(1 + rand() % 20);
+                break;
+            case 3:
+                if (rand() % 50 == 0)
+                {
+                    snaps.push_back(tree.snapshot());
+                    snapsizes.push_back(m.size());
+                }
+                break;
+            default:
+                m[key] = i;
+                tree[key] = i;
+                break;
+            }
+            if (i % 5000 == 0)
+            {
+                tree.relayout();
+                check();
+            }
+        }
+        tree.relayout();
+        check();
+        for (size_t i = 0; i < snaps.size(); ++i)
+        {
+            size_t n = 0;
+            for (trie_type::snapshot_type::const_iterator it = snaps[i].begin(); it != snaps[i].end(); ++it)
+                ++n;
+            assert(n == snapsizes[i]);
+        }
+
+        // A copy, relaid out with the original gone
+        trie_type *pCopy = new trie_type(tree);
+        pCopy->relayout(10);
+        tree.clear();
+        pCopy->relayout();
+        assert(pCopy->size() == m.size());
+        delete pCopy;
+    }
+
+    void check()
+    {
+        assert(tree.size() == m.size());
+        assert(tree.count_prefix("") == m.size());
+        map<string, int>::iterator mit = m.begin();
+        for (trie_type::iterator it = tree.begin(); it != tree.end(); ++it, ++mit)
+        {
+            assert((*it).first == mit->first && (*it).second == mit->second);
+        }
+        assert(mit == m.end());
+    }
+
+    trie_type tree;
+    map<string, int> m;
+};
+
+// top_k() must give the same scores as sorting the keys with the prefix, through inserts,
+// erases, writes through iterators, erase_prefix(), merge() and relayout()
+class TopKTest
+{
+public:
+    typedef stringtrie<int, stringtrie_scored_traits> trie_type;
+
+    // Ranked by a member of the value
+    struct Symbol
+    {
+        int id;
+        double volume;
+    };
+
+    struct volume_traits : public stringtrie_traits
+    {
+        enum {
+            SUBTREE_SCORES = 1
+        };
+        static double score(const Symbol& s) { return s.volume; }
+    };
+
+    void test()
+    {
+        srand(23);
+        trie_type::snapshot_type snap;
+        for (int i = 0; i < 20000; ++i)
+        {
+            string key = randomkey();
+            int v = rand() % 1000;
+            switch (rand() % 10)
+            {
+            case 0:
+            case 1:
+                m.erase(key);
+                tree.erase(key);
+                break;
+            case 2:
+                // Change the value of a key already in the trie through its iterator
+                if (tree.find(key) != tree.end())
+                {
+                    tree.find(key).value() = v;
+                    m[key] = v;
+                }
+                break;
+            case 3:
+                if (rand() % 100 == 0)
+                {
+                    string prefix = key.substr(0, 2);
+                    tree.erase_prefix(prefix);
+                    m.erase(m.lower_bound(prefix), m.lower_bound(prefix + "~"));
+                }
+                else if (rand() % 20 == 0)
+                {
+                    snap = tree.snapshot();
+                }
+                else if (rand() % 10 == 0)
+                {
+                    tree.relayout(1 + rand() % 20);
+                }
+                break;
+            default:
+                m[key] = v;
+                tree[key] = v;
+                break;
+            }
+            if (i % 50 == 0)
+                check(randomkey().substr(0, rand() % 3), 1 + rand() % 10);
+        }
+
+        // Keys merged in from another trie, some of them with better scores
+        trie_type other;
+        for (int i = 0; i < 500; ++i)
+        {
+            string key = randomkey();
+            if (m.count(key) == 0)
+            {
+                m[key] = 1000 + i;
+                other[key] = 1000 + i;
+            }
+        }
+        tree.merge(other);
+        for (int i = 0; i < 200; ++i)
+            check(randomkey().substr(0, rand() % 3), 1 + rand() % 10);
+        check("", m.size() + 1);
+        assert(tree.top_k("", 0).empty());
+        assert(tree.top_k("QQ", 5).empty());
+
+        stringtrie<Symbol, volume_traits> symbols;
+        Symbol s[] = { {1, 2.5}, {2, 9.0}, {3, 0.5}, {4, 7.25} };
+        symbols.insert(stringtrie<Symbol, volume_traits>::value_type("ESZ5", s[0]));
+        symbols.insert(stringtrie<Symbol, volume_traits>::value_type("ESH6", s[1]));
+        symbols.insert(stringtrie<Symbol, volume_traits>::value_type("NQZ5", s[2]));
+        symbols.insert(stringtrie<Symbol, volume_traits>::value_type("ESM6", s[3]));
+        vector<stringtrie<Symbol, volume_traits>::iterator> best = symbols.top_k("ES", 2);
+        assert(best.size() == 2 && (*best[0]).second.id == 2 && (*best[1]).second.id == 4);
+    }
+
+    // The scores must be the k best in order, from distinct keys with the prefix
+    void check(const string& prefix, size_t k)
+    {
+        vector<int> expected;
+        for (map<string, int>::iterator it = m.lower_bound(prefix); it != m.end() && it->first.compare(0, prefix.length(), prefix) == 0; ++it)
+            expected.push_back(it->second);
+        sort(expected.begin(), expected.end(), greater<int>());
+        if (expected.size() > k)
+            expected.resize(k);
+
+        vector<trie_type::iterator> result = tree.top_k(prefix, k);
+        assert(result.size() == expected.size());
+        set<string> keys;
+        for (size_t i = 0; i < result.size(); ++i)
+        {
+            string key = (*result[i]).first;
+            assert(key.compare(0, prefix.length(), prefix) == 0);
+            assert((*result[i]).second == expected[i] && m[key] == expected[i]);
+            assert(keys.insert(key).second);
+        }
+    }
+
+    trie_type tree;
+    map<string, int> m;
+};
+
+// A trie whose nodes burst at two children must hold the same keys as a map through
+// every kind of change, and use less memory than a trie with a table in every node
+class BurstTest
+{
+public:
+    struct small_burst_traits : public stringtrie_counted_traits
+    {
+        enum {
+            BURST_LIMIT = 2
+        };
+    };
+    typedef stringtrie<int, small_burst_traits> trie_type;
+
+    void test()
+    {
+        srand(29);
+        trie_type::snapshot_type snap;
+        size_t snapsize = 0;
+        for (int i = 0; i < 20000; ++i)
+        {
+            string key = randomkey(6);
+            switch (rand() % 10)
+            {
+            case 0:
+            case 1:
+                m.erase(key);
+                tree.erase(key);
+                break;
+            case 2:
+                if (rand() % 100 == 0)
+                {
+                    string prefix = key.substr(0, 2);
+                    tree.erase_prefix(prefix);
+                    m.erase(m.lower_bound(prefix), m.lower_bound(prefix + "~"));
+                }
+                else if (rand() % 50 == 0)
+                {
+                    snap = tree.snapshot();
+                    snapsize = m.size();
+                }
+                else if (rand() % 10 == 0)
+                {
+                    tree.relayout(1 + rand() % 20);
+                }
+                break;
+            default:
+                m[key] = i;
+                tree[key] = i;
+                break;
+            }
+            if (i % 2000 == 0)
+                check();
+        }
+        check();
+        size_t n = 0;
+        for (trie_type::snapshot_type::const_iterator it = snap.begin(); it != snap.end(); ++it)
+            ++n;
+        assert(n == snapsize);
+
+        for (int i = 0; i < 1000; ++i)
+        {
+            string key = randomkey(6);
+            map<string, int>::iterator mit = m.lower_bound(key);
+            trie_type::iterator it = tree.lower_bound(key);
+            assert(mit == m.end() ? it == tree.end() : (*it).first == mit->first);
+            string prefix = key.substr(0, 1 + rand() % 2);
+            size_t count = 0;
+            for (mit = m.lower_bound(prefix); mit != m.end() && mit->first.compare(0, prefix.length(), prefix) == 0; ++mit)
+                ++count;
+            assert(tree.count_prefix(prefix) == count);
+        }
+
+        // The same keys with a table in every node
+        stringtrie<int, stringtrie_counted_traits> full;
+        for (map<string, int>::iterator mit = m.begin(); mit != m.end(); ++mit)
+            full.insert(stringtrie<int, stringtrie_counted_traits>::value_type(mit->first, mit->second));
+        assert(tree.getmemusage() < full.getmemusage());
+
+        trie_type other;
+        for (int i = 0; i < 500; ++i)
+            other[randomkey(6) + "Z"] = i;
+        trie_type result;
+        set_difference(tree, other, result);
+        set_union(result, other, tree);
+        for (trie_type::iterator it = other.begin(); it != other.end(); ++it)
+            m[(*it).first] = (*it).second;
+        tree.merge(other);
+        check();
+    }
+
+    // Forwards and backwards against the map
+    void check()
+    {
+        assert(tree.size() == m.size());
+        assert(tree.count_prefix("") == m.size());
+        map<string, int>::iterator mit = m.begin();
+        for (trie_type::iterator it = tree.begin(); it != tree.end(); ++it, ++mit)
+        {
+            assert((*it).first == mit->first && (*it).second == mit->second);
+        }
+        assert(mit == m.end());
+        map<string, int>::reverse_iterator rmit = m.rbegin();
+        for (trie_type::reverse_iterator it = tree.rbegin(); it != tree.rend(); ++it, ++rmit)
+        {
+            assert((*it).first == rmit->first);
+        }
+        assert(rmit == m.rend());
+    }
+
+    trie_type tree;
+    map<string, int> m;
+};
+
+// Lookups with keys in any case and with separators must find what a map of the
+// normalized keys finds
+class NormalizeTest
+{
+public:
+    struct counted_normalized_traits : public stringtrie_normalized_traits
+    {
+        enum {
+            SUBTREE_COUNTS = 1
+        };
+    };
+    typedef stringtrie<int, counted_normalized_traits> trie_type;
+
+    void test()
+    {
+        // Only text keys can be normalized, a stringtrie with the others does not compile
+        static_assert(stringtrie_normalizable<counted_normalized_traits>::value, "");
+        static_assert(stringtrie_normalizable<stringtrie_keyed_traits<uint64_t> >::value, "");
+        static_assert(!stringtrie_normalizable<stringtrie_keyed_traits<uint64_t, stringtrie_normalized_traits> >::value, "");
+        static_assert(!stringtrie_normalizable<stringtrie_keyed_traits<basic_string<unsigned char>, stringtrie_normalized_traits> >::value, "");
+
+        srand(31);
+        trie_type::snapshot_type snap;
+        map<string, int> snapm;
+        for (int i = 0; i < 20000; ++i)
+        {
+            string key = randommixedkey();
+            switch (rand() % 8)
+            {
+            case 0:
+                assert(tree.erase(key) == m.erase(normalize(key)));
+                break;
+            case 1:
+            {
+                trie_type::iterator it = tree.find(key);
+                map<string, int>::iterator mit = m.find(normalize(key));
+                assert(mit == m.end() ? it == tree.end() : (*it).first == mit->first && (*it).second == mit->second);
+                assert(tree.count(key) == m.count(normalize(key)));
+                break;
+            }
+            case 2:
+            {
+                trie_type::iterator it = tree.lower_bound(key);
+                map<string, int>::iterator mit = m.lower_bound(normalize(key));
+                assert(mit == m.end() ? it == tree.end() : (*it).first == mit->first);
+                size_t r = 0;
+                for (map<string, int>::iterator j = m.begin(); j != mit; ++j)
+                    ++r;
+                assert(tree.rank(key) == r);
+                break;
+            }
+            case 3:
+            {
+                string prefix = key.substr(0, 1 + rand() % 3);
+                string normal = normalize(prefix);
+                size_t n = 0;
+                for (map<string, int>::iterator mit = m.lower_bound(normal); mit != m.end() && mit->first.compare(0, normal.length(), normal) == 0; ++mit)
+                    ++n;
+                assert(tree.count_prefix(prefix) == n);
+                if (rand() % 50 == 0)
+                {
+                    assert(tree.erase_prefix(prefix) == n);
+                    m.erase(m.lower_bound(normal), m.lower_bound(normal + "~"));
+                }
+                break;
+            }
+            case 4:
+                if (rand() % 50 == 0)
+                {
+                    snap = tree.snapshot();
+                    snapm = m;
+                }
+                break;
+            default:
+                if (m.count(normalize(key)) == 0)
+                    m[normalize(key)] = i;
+                tree.insert(trie_type::value_type(key, i));
+                break;
+            }
+        }
+        assert(tree.size() == m.size());
+        map<string, int>::iterator mit = m.begin();
+        for (trie_type::iterator it = tree.begin(); it != tree.end(); ++it, ++mit)
+        {
+            assert((*it).first == mit->first && (*it).second == mit->second);
+        }
+        assert(mit == m.end());
+        for (int i = 0; i < 1000; ++i)
+        {
+            string key = randommixedkey();
+            const int *p = snap.find(key);
+            map<string, int>::iterator sit = snapm.find(normalize(key));
+            assert(sit == snapm.end() ? p == NULL : *p == sit->second);
+        }
+
+        stringtrie<int, stringtrie_normalized_traits> symbols;
+        symbols.insert(stringtrie<int, stringtrie_normalized_traits>::value_type("ES Z5", 1));
+        assert(symbols.find("esz5") != symbols.end() && symbols.find("ES-Z5") != symbols.end() && symbols.find("e.s/z_5") != symbols.end());
+        assert(symbols.find("ESZ") == symbols.end() && symbols.find("ESZ5 ") != symbols.end());
+        assert((*symbols.begin()).first == "ESZ5");
+    }
+
+    static string normalize(const string& key)
+    {
+        string r;
+        for (size_t i = 0; i < key.size(); ++i)
+        {
+            if (stringtrie_normalized_traits::ignore(key[i]) == false)
+                r += stringtrie_normalized_traits::fold(key[i]);
+        }
+        return r;
+    }
+
+    // Letters in either case with separators between them
+    string randommixedkey()
+    {
+        string key;
+        int len = 1 + rand() % 5;
+        for (int i = 0; i < len; ++i)
+        {
+            if (rand() % 4 == 0)
+                key += " -_./"[rand() % 5];
+            key += "ABCEZabcez"[rand() % 10];
+        }
+        return key;
+    }
+
+    trie_type tree;
+    map<string, int> m;
+};
+
+// FIX tag names, for the static trie
+constexpr std::pair<std::string_view, int> fixtags[] = {
+    {"Account", 1}, {"AvgPx", 6}, {"BeginSeqNo", 7}, {"BeginString", 8}, {"BodyLength", 9},
+    {"CheckSum", 10}, {"ClOrdID", 11}, {"Commission", 12}, {"CumQty", 14}, {"Currency", 15},
+    {"EndSeqNo", 16}, {"ExecID", 17}, {"ExecInst", 18}, {"HandlInst", 21}, {"SecurityIDSource", 22},
+    {"LastPx", 31}, {"LastQty", 32}, {"MsgSeqNum", 34}, {"MsgType", 35}, {"NewSeqNo", 36},
+    {"OrderID", 37}, {"OrderQty", 38}, {"OrdStatus", 39}, {"OrdType", 40}, {"OrigClOrdID", 41},
+    {"PossDupFlag", 43}, {"Price", 44}, {"RefSeqNum", 45}, {"SecurityID", 48}, {"SenderCompID", 49},
+    {"SenderSubID", 50}, {"SendingTime", 52}, {"Side", 54}, {"Symbol", 55}, {"TargetCompID", 56},
+    {"TargetSubID", 57}, {"Text", 58}, {"TimeInForce", 59}, {"TransactTime", 60},
+    {"ValidUntilTime", 62}, {"SettlType", 63}, {"SettlDate", 64}, {"SymbolSfx", 65},
+    {"EncryptMethod", 98}, {"StopPx", 99}, {"ExDestination", 100}, {"HeartBtInt", 108},
+    {"MaxFloor", 111}, {"TestReqID", 112}, {"ExecType", 150}, {"LeavesQty", 151},
+    {"SecurityType", 167}, {"MaturityMonthYear", 200}
+};
+
+// The static trie must find what a stringtrie of the same keys finds, including when
+// the key is only a part of, or longer than, a tag name
+class StaticTest
+{
+public:
+    typedef static_stringtrie<fixtags> fixtag_trie;
+
+    void test()
+    {
+        static_assert(fixtag_trie::find("MsgType")->second == 35, "found by the compiler");
+        static_assert(fixtag_trie::find("MsgTyp") == fixtag_trie::end(), "found by the compiler");
+
+        stringtrie<int> tree;
+        map<string, int> m;
+        for (size_t i = 0; i < sizeof(fixtags) / sizeof(fixtags[0]); ++i)
+        {
+            string key(fixtags[i].first);
+            tree.insert(stringtrie<int>::value_type(key, fixtags[i].second));
+            m.insert(map<string, int>::value_type(key, fixtags[i].second));
+        }
+        assert(fixtag_trie::size() == tree.size());
+
+        map<string, int>::iterator mit = m.begin();
+        for (fixtag_trie::const_iterator it = fixtag_trie::begin(); it != fixtag_trie::end(); ++it, ++mit)
+        {
+            assert(it->first == mit->first && it->second == mit->second);
+        }
+
+        for (map<string, int>::iterator it = m.begin(); it != m.end(); ++it)
+        {
+            const string& key = it->first;
+            check(key, tree);
+            for (size_t len = 0; len < key.size(); ++len)
+                check(key.substr(0, len), tree);
+            check(key + "X", tree);
+            check(key.substr(1), tree);
+        }
+    }
+
+    void check(const string& key, stringtrie<int>& tree)
+    {
+        fixtag_trie::const_iterator it = fixtag_trie::find(key);
+        stringtrie<int>::iterator tit = tree.find(key);
+        assert((it == fixtag_trie::end()) == (tit == tree.end()));
+        if (it != fixtag_trie::end())
+            assert(it->second == (*tit).second && it->first == key);
+    }
+};
+
+// scan() must report the same matches as checking every key at every offset,
+// and must see changes made to the trie since the last scan
+class ScanTest
+{
+public:
+    typedef stringtrie<int, stringtrie_scan_traits> trie_type;
+
+    struct collect
+    {
+        collect(vector<pair<size_t, int> >& m) : matches(m) {}
+        void operator()(size_t offset, size_t, const int& value)
+        {
+            matches.push_back(pair<size_t, int>(offset, value));
+        }
+        vector<pair<size_t, int> >& matches;
+    };
+
+    void test()
+    {
+        srand(11);
+        for (int i = 0; i < 200; ++i)
+        {
+            string key = randomkey();
+            m[key] = i;
+            tree[key] = i;
+        }
+        string text;
+        for (int i = 0; i < 5000; ++i)
+            text += "ABCEZ "[rand() % 6];
+        check(text);
+
+        // Changes after the links were built
+        for (int i = 0; i < 100; ++i)
+        {
+            string key = randomkey();
+            if (rand() % 2)
+            {
+                m.erase(key);
+                tree.erase(key);
+            }
+            else
+            {
+                m[key] = i;
+                tree[key] = i;
+            }
+        }
+        check(text);
+
+        trie_type::snapshot_type snap = tree.snapshot();
+        tree.insert(trie_type::value_type("ZZZZZZ", -1));
+        m["ZZZZZZ"] = -1;
+        check(text + "ZZZZZZZ");
+    }
+
+    void check(const string& text)
+    {
+        vector<pair<size_t, int> > expected;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            for (map<string, int>::iterator it = m.begin(); it != m.end(); ++it)
+            {
+                if (text.compare(i, it->first.size(), it->first) == 0)
+                    expected.push_back(pair<size_t, int>(i, it->second));
+            }
+        }
+        vector<pair<size_t, int> > matches;
+        size_t n = tree.scan(text, collect(matches));
+        assert(n == matches.size());
+        sort(expected.begin(), expected.end());
+        sort(matches.begin(), matches.end());
+        assert(matches == expected);
+    }
+
+    trie_type tree;
+    map<string, int> m;
+};
+
+enum
+{
+    TEST_ITERATIONS = 1000000
+};
+
+void testMap(vector<string>& data)
+{
+    map<string, int> m;
+
+    LARGE_INTEGER loadStart;
+    LARGE_INTEGER loadStop;
+    LARGE_INTEGER runStart;
+    LARGE_INTEGER runStop;
+    QueryPerformanceCounter(&loadStart);
+    loadPTable(m);
+    QueryPerformanceCounter(&loadStop);
+
+    _int64 loadTime = loadStop.QuadPart - loadStart.QuadPart;
+    srand(1);
+    int n = data.size();
+    QueryPerformanceCounter(&runStart);
+    for (int i = 0; i < TEST_ITERATIONS; ++i)
+    {
+        int idx = rand() % n;
+        auto it = m.find(data[idx]);
+        assert(it != m.end());
+    }
+    QueryPerformanceCounter(&runStop);
+    _int64 runTime = runStop.QuadPart - runStart.QuadPart;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    double load = (double)loadTime/(double)freq.QuadPart;
+    double run = (double)runTime/(double)freq.QuadPart;
+    cout << "map: LoadTime: " << load << " secs, runTime: " << run << " secs" << endl;
+    cout << "avg find: " << (run/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+    cout << "avg load: " << (load/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+
+}
+
+void testUnorderedMap(vector<string>& data)
+{
+    unordered_map<string, int> m;
+
+    LARGE_INTEGER loadStart;
+    LARGE_INTEGER loadStop;
+    LARGE_INTEGER runStart;
+    LARGE_INTEGER runStop;
+    QueryPerformanceCounter(&loadStart);
+    loadPTable(m);
+    QueryPerformanceCounter(&loadStop);
+
+    _int64 loadTime = loadStop.QuadPart - loadStart.QuadPart;
+    srand(1);
+    int n = data.size();
+    QueryPerformanceCounter(&runStart);
+    for (int i = 0; i < TEST_ITERATIONS; ++i)
+    {
+        int idx = rand() % n;
+        auto it = m.find(data[idx]);
+        assert(it != m.end());
     }
     QueryPerformanceCounter(&runStop);
+    _int64 runTime = runStop.QuadPart - runStart.QuadPart;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    double load = (double)loadTime/(double)freq.QuadPart;
+    double run = (double)runTime/(double)freq.QuadPart;
+    cout << "unordered_map: LoadTime: " << load << " secs, runTime: " << run << " secs" << endl;
+    cout << "avg find: " << (run/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+    cout << "avg load: " << (load/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+}
+
+void testTrie(vector<string>& data)
+{
+    stringtrie<int> tree;
+
+    LARGE_INTEGER loadStart;
+    LARGE_INTEGER loadStop;
+    LARGE_INTEGER runStart;
+    LARGE_INTEGER runStop;
+    QueryPerformanceCounter(&loadStart);
+    loadPTable(tree);
+    QueryPerformanceCounter(&loadStop);
+
+    _int64 loadTime = loadStop.QuadPart - loadStart.QuadPart;
+
+    srand(1);
+    int n = data.size();
+    QueryPerformanceCounter(&runStart);
+    for (int i = 0; i < TEST_ITERATIONS; ++i)
+    {
+        int idx = rand() % n;
+        stringtrie<int>::iterator it = tree.find(data[idx]);
+        assert((*it).second != false);
+    }
+    QueryPerformanceCounter(&runStop);
+
+    _int64 runTime = runStop.QuadPart - runStart.QuadPart;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    double load = (double)loadTime/(double)freq.QuadPart;
+    double run = (double)runTime/(double)freq.QuadPart;
+    cout << "trie: LoadTime: " << load << " secs, runTime: " << run << " secs" << endl;
+    cout << "avg find: " << (run/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+    cout << "avg load: " << (load/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+
+    cout << "size: " << tree.size() << ", Num nodes: " << tree.getnumnodes() << ", mem: " << tree.getmemusage() << ", mem/node: " << tree.getmemusage()/tree.size() << endl;
+}
+
+class DataCompare
+{
+public:
+    bool operator()(const pair<string, int>& p1, const pair<string, int>& p2)
+    {
+        return p1.first < p2.first;
+    }
+
+    bool operator()(const pair<string, int>& p1, const string& s)
+    {
+        return p1.first < s;
+    }
+
+    bool operator()(const string& s, const pair<string, int>& p1)
+    {
+        return s < p1.first;
+    }
+};
+
+void testSortedVector(vector<string>& data)
+{
+    vector<std::pair<std::string, int> > m;
+    
+    LARGE_INTEGER loadStart;
+    LARGE_INTEGER loadStop;
+    LARGE_INTEGER runStart;
+    LARGE_INTEGER runStop;
+    QueryPerformanceCounter(&loadStart);
+    for each(const string &s in data)
+    {
+        m.push_back(pair<string, int>(s, 0));
+    }
+
+    sort(m.begin(), m.end(), DataCompare());
+    QueryPerformanceCounter(&loadStop);
+
+    _int64 loadTime = loadStop.QuadPart - loadStart.QuadPart;
+
+    srand(1);
+    int n = data.size();
+    QueryPerformanceCounter(&runStart);
+    for (int i = 0; i < TEST_ITERATIONS; ++i)
+    {
+        int idx = rand() % n;
+        vector<std::pair<std::string, int> >::iterator it = lower_bound(m.begin(), m.end(), data[idx], DataCompare());
+        assert(it != m.end());
+    }
+    QueryPerformanceCounter(&runStop);
+
+    _int64 runTime = runStop.QuadPart - runStart.QuadPart;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    double load = (double)loadTime/(double)freq.QuadPart;
+    double run = (double)runTime/(double)freq.QuadPart;
+    cout << "vector: LoadTime: " << load << " secs, runTime: " << run << " secs" << endl;
+    cout << "avg find: " << (run/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+    cout << "avg load: " << (load/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+}
+
+// Instrument like keys: a root symbol, a month code, a year and a strike
+void makekeys(vector<string>& keys, int n, unsigned int seed)
+{
+    srand(seed);
+    keys.clear();
+    while ((int)keys.size() < n)
+    {
+        char buf[32];
+        sprintf(buf, "%c%c%c%d %c%d", 'A' + rand() % 26, 'A' + rand() % 26, "FGHJKMNQUVXZ"[rand() % 12], rand() % 10,
+            "CP"[rand() % 2], (rand() * 31 + rand()) % 100000);
+        keys.push_back(buf);
+    }
+}
+
+// Web addresses: a site, a section and a page or an id, most of each shared with others
+void makeurls(vector<string>& keys, int n, unsigned int seed)
+{
+    static const char *sites[] = { "https://www.cmegroup.com/", "https://www.ice.com/", "https://www.eurex.com/", "https://www.lseg.com/", "http://intranet.local/" };
+    static const char *sections[] = { "markets/", "products/", "trading/", "clearing/", "data/", "news/", "rules/" };
+    static const char *pages[] = { "overview", "contract-specs", "margins", "settlements", "calendar", "notices/" };
+    srand(seed);
+    keys.clear();
+    while ((int)keys.size() < n)
+    {
+        char buf[160];
+        sprintf(buf, "%s%s%s%d", sites[rand() % 5], sections[rand() % 7], pages[rand() % 6], ((unsigned int)rand() * 31 + rand()) % 1000000);
+        keys.push_back(buf);
+    }
+}
+
+// Random version 4 UUIDs, which share almost nothing past the first few characters
+void makeuuids(vector<string>& keys, int n, unsigned int seed)
+{
+    srand(seed);
+    keys.clear();
+    while ((int)keys.size() < n)
+    {
+        string key;
+        for (int i = 0; i < 36; ++i)
+        {
+            if (i == 8 || i == 13 || i == 18 || i == 23)
+                key += '-';
+            else if (i == 14)
+                key += '4';
+            else
+                key += "0123456789abcdef"[rand() % 16];
+        }
+        keys.push_back(key);
+    }
+}
 
-    _int64 runTime = runStop.QuadPart - runStart.QuadPart;
+double elapsed(LARGE_INTEGER& start)
+{
+    LARGE_INTEGER stop;
     LARGE_INTEGER freq;
+    QueryPerformanceCounter(&stop);
     QueryPerformanceFrequency(&freq);
-    double load = (double)loadTime/(double)freq.QuadPart;
-    double run = (double)runTime/(double)freq.QuadPart;
-    cout << "vector: LoadTime: " << load << " secs, runTime: " << run << " secs" << endl;
-    cout << "avg find: " << (run/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
-    cout << "avg load: " << (load/(double)TEST_ITERATIONS) * 1000000 << " usec, " << (run/(double)TEST_ITERATIONS) * 1000000000 << " nsec" << endl;
+    return (double)(stop.QuadPart - start.QuadPart)/(double)freq.QuadPart;
+}
+
+enum
+{
+    SETOP_KEYS = 1000000
+};
+
+// The set operations against iterating one trie and probing the other, on two
+// sets of SETOP_KEYS keys that share half their keys
+void testSetOperations()
+{
+    vector<string> keys;
+    makekeys(keys, SETOP_KEYS * 3 / 2, 1);
+    stringtrie<int> a;
+    stringtrie<int> b;
+    for (int i = 0; i < SETOP_KEYS; ++i)
+    {
+        a.insert(stringtrie<int>::value_type(keys[i], i));
+        b.insert(stringtrie<int>::value_type(keys[i + SETOP_KEYS / 2], i));
+    }
+
+    LARGE_INTEGER start;
+    {
+        stringtrie<int> result;
+        QueryPerformanceCounter(&start);
+        set_intersection(a, b, result);
+        double t1 = elapsed(start);
+
+        stringtrie<int> probe;
+        QueryPerformanceCounter(&start);
+        for (stringtrie<int>::iterator it = a.begin(); it != a.end(); ++it)
+        {
+            if (b.find((*it).first) != b.end())
+                probe.insert(stringtrie<int>::value_type((*it).first, (*it).second));
+        }
+        double t2 = elapsed(start);
+        assert(probe.size() == result.size());
+        cout << "intersection: " << t1 << " secs, iterate and find: " << t2 << " secs" << endl;
+    }
+    {
+        stringtrie<int> result;
+        QueryPerformanceCounter(&start);
+        set_difference(a, b, result);
+        double t1 = elapsed(start);
+
+        stringtrie<int> probe;
+        QueryPerformanceCounter(&start);
+        for (stringtrie<int>::iterator it = a.begin(); it != a.end(); ++it)
+        {
+            if (b.find((*it).first) == b.end())
+                probe.insert(stringtrie<int>::value_type((*it).first, (*it).second));
+        }
+        double t2 = elapsed(start);
+        assert(probe.size() == result.size());
+        cout << "difference: " << t1 << " secs, iterate and find: " << t2 << " secs" << endl;
+    }
+    {
+        stringtrie<int> result;
+        QueryPerformanceCounter(&start);
+        set_union(a, b, result);
+        double t1 = elapsed(start);
+        result.clear();
+
+        stringtrie<int> probe;
+        QueryPerformanceCounter(&start);
+        probe = a;
+        for (stringtrie<int>::iterator it = b.begin(); it != b.end(); ++it)
+        {
+            probe.insert(stringtrie<int>::value_type((*it).first, (*it).second));
+        }
+        double t2 = elapsed(start);
+        cout << "union: " << t1 << " secs, copy and insert: " << t2 << " secs" << endl;
+    }
+    {
+        // merge() leaves b empty, so the equivalent is to insert and then clear b. This
+        // uses up a and b, they are built again for merge() rather than copied first, so
+        // that no more than two tries are held at a time.
+        QueryPerformanceCounter(&start);
+        for (stringtrie<int>::iterator it = b.begin(); it != b.end(); ++it)
+        {
+            a.insert(stringtrie<int>::value_type((*it).first, (*it).second));
+        }
+        b.clear();
+        double t2 = elapsed(start);
+
+        a.clear();
+        for (int i = 0; i < SETOP_KEYS; ++i)
+        {
+            a.insert(stringtrie<int>::value_type(keys[i], i));
+            b.insert(stringtrie<int>::value_type(keys[i + SETOP_KEYS / 2], i));
+        }
+        QueryPerformanceCounter(&start);
+        a.merge(b);
+        double t1 = elapsed(start);
+        cout << "merge: " << t1 << " secs, iterate, insert and clear: " << t2 << " secs" << endl;
+    }
+}
+
+// Load throughput of stringtrie_load() against reading with getline() into
+// strings and inserting them
+void testLoader(const char *filename)
+{
+    stringtrie<int> tree;
+    stringtrie_loadstats stats;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    stringtrie_load(filename, tree, ';', '\n', &stats);
+    double t1 = elapsed(start);
+
+    stringtrie<int> tree2;
+    QueryPerformanceCounter(&start);
+    ifstream strm;
+    strm.open(filename);
+    string key;
+    string rest;
+    while (getline(strm, key, ';'))
+    {
+        tree2.insert(stringtrie<int>::value_type(key, 0));
+        getline(strm, rest, '\n');
+    }
+    double t2 = elapsed(start);
+    assert(tree.size() == tree2.size());
+
+    double mb = stats.bytes / (1024.0 * 1024.0);
+    cout << "loader: " << mb << " MB, " << stats.keys << " keys, " << t1 << " secs, " << mb / t1 << " MB/s" << endl;
+    cout << "getline: " << t2 << " secs, " << mb / t2 << " MB/s" << endl;
+}
+
+enum
+{
+    LOG_KEYS = 1000000
+};
+
+// The cost of logging inserts, and the time to recover from a checkpoint and a log
+void testLog()
+{
+    const char *path = "stringtrie_log_bench";
+    vector<string> keys;
+    makekeys(keys, LOG_KEYS, 2);
+    LARGE_INTEGER start;
+
+    double direct;
+    {
+        stringtrie<int> tree;
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < LOG_KEYS; ++i)
+            tree.insert(stringtrie<int>::value_type(keys[i], i));
+        direct = elapsed(start);
+    }
+
+    double logged;
+    double logsecs;
+    {
+        stringtrie<int> tree;
+        stringtrie_log<int> log(tree, path);
+        log.open();
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < LOG_KEYS; ++i)
+        {
+            log.insert(stringtrie<int>::value_type(keys[i], i));
+            if (i == LOG_KEYS / 2)
+                log.checkpoint();
+        }
+        log.commit();
+        logged = elapsed(start);
+
+        // Replaying the records after the checkpoint
+        log.close();
+        stringtrie<int> tree2;
+        stringtrie_log<int> log2(tree2, path);
+        QueryPerformanceCounter(&start);
+        log2.open();
+        logsecs = elapsed(start);
+        assert(tree2.size() == tree.size());
+
+        // Recovering all of it from a checkpoint
+        log2.checkpoint();
+        log2.close();
+    }
+
+    stringtrie<int> tree;
+    stringtrie_log<int> log(tree, path);
+    QueryPerformanceCounter(&start);
+    log.open();
+    double checkpointsecs = elapsed(start);
+    log.close();
+    remove((string(path) + ".ckpt").c_str());
+    for (int n = 0; n < 10; ++n)
+    {
+        char buf[64];
+        sprintf(buf, "%s.%d.log", path, n);
+        remove(buf);
+    }
+
+    cout << "insert: " << direct << " secs, logged insert: " << logged << " secs, overhead: " 
+        << (logged - direct) / LOG_KEYS * 1000000000 << " nsec/insert" << endl;
+    cout << "recover half checkpoint, half log: " << logsecs << " secs, all checkpoint: " << checkpointsecs << " secs" << endl;
+}
+
+// FNV-1a, for the switch on hash below
+constexpr unsigned int fixhash(std::string_view key)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < key.size(); ++i)
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    return h;
+}
+
+// The usual hand written alternative to a static table
+int fixtagswitch(std::string_view key)
+{
+    switch (fixhash(key))
+    {
+    case fixhash("Account"): return key == "Account" ? 1 : -1;
+    case fixhash("AvgPx"): return key == "AvgPx" ? 6 : -1;
+    case fixhash("BeginSeqNo"): return key == "BeginSeqNo" ? 7 : -1;
+    case fixhash("BeginString"): return key == "BeginString" ? 8 : -1;
+    case fixhash("BodyLength"): return key == "BodyLength" ? 9 : -1;
+    case fixhash("CheckSum"): return key == "CheckSum" ? 10 : -1;
+    case fixhash("ClOrdID"): return key == "ClOrdID" ? 11 : -1;
+    case fixhash("Commission"): return key == "Commission" ? 12 : -1;
+    case fixhash("CumQty"): return key == "CumQty" ? 14 : -1;
+    case fixhash("Currency"): return key == "Currency" ? 15 : -1;
+    case fixhash("EndSeqNo"): return key == "EndSeqNo" ? 16 : -1;
+    case fixhash("ExecID"): return key == "ExecID" ? 17 : -1;
+    case fixhash("ExecInst"): return key == "ExecInst" ? 18 : -1;
+    case fixhash("HandlInst"): return key == "HandlInst" ? 21 : -1;
+    case fixhash("SecurityIDSource"): return key == "SecurityIDSource" ? 22 : -1;
+    case fixhash("LastPx"): return key == "LastPx" ? 31 : -1;
+    case fixhash("LastQty"): return key == "LastQty" ? 32 : -1;
+    case fixhash("MsgSeqNum"): return key == "MsgSeqNum" ? 34 : -1;
+    case fixhash("MsgType"): return key == "MsgType" ? 35 : -1;
+    case fixhash("NewSeqNo"): return key == "NewSeqNo" ? 36 : -1;
+    case fixhash("OrderID"): return key == "OrderID" ? 37 : -1;
+    case fixhash("OrderQty"): return key == "OrderQty" ? 38 : -1;
+    case fixhash("OrdStatus"): return key == "OrdStatus" ? 39 : -1;
+    case fixhash("OrdType"): return key == "OrdType" ? 40 : -1;
+    case fixhash("OrigClOrdID"): return key == "OrigClOrdID" ? 41 : -1;
+    case fixhash("PossDupFlag"): return key == "PossDupFlag" ? 43 : -1;
+    case fixhash("Price"): return key == "Price" ? 44 : -1;
+    case fixhash("RefSeqNum"): return key == "RefSeqNum" ? 45 : -1;
+    case fixhash("SecurityID"): return key == "SecurityID" ? 48 : -1;
+    case fixhash("SenderCompID"): return key == "SenderCompID" ? 49 : -1;
+    case fixhash("SenderSubID"): return key == "SenderSubID" ? 50 : -1;
+    case fixhash("SendingTime"): return key == "SendingTime" ? 52 : -1;
+    case fixhash("Side"): return key == "Side" ? 54 : -1;
+    case fixhash("Symbol"): return key == "Symbol" ? 55 : -1;
+    case fixhash("TargetCompID"): return key == "TargetCompID" ? 56 : -1;
+    case fixhash("TargetSubID"): return key == "TargetSubID" ? 57 : -1;
+    case fixhash("Text"): return key == "Text" ? 58 : -1;
+    case fixhash("TimeInForce"): return key == "TimeInForce" ? 59 : -1;
+    case fixhash("TransactTime"): return key == "TransactTime" ? 60 : -1;
+    case fixhash("ValidUntilTime"): return key == "ValidUntilTime" ? 62 : -1;
+    case fixhash("SettlType"): return key == "SettlType" ? 63 : -1;
+    case fixhash("SettlDate"): return key == "SettlDate" ? 64 : -1;
+    case fixhash("SymbolSfx"): return key == "SymbolSfx" ? 65 : -1;
+    case fixhash("EncryptMethod"): return key == "EncryptMethod" ? 98 : -1;
+    case fixhash("StopPx"): return key == "StopPx" ? 99 : -1;
+    case fixhash("ExDestination"): return key == "ExDestination" ? 100 : -1;
+    case fixhash("HeartBtInt"): return key == "HeartBtInt" ? 108 : -1;
+    case fixhash("MaxFloor"): return key == "MaxFloor" ? 111 : -1;
+    case fixhash("TestReqID"): return key == "TestReqID" ? 112 : -1;
+    case fixhash("ExecType"): return key == "ExecType" ? 150 : -1;
+    case fixhash("LeavesQty"): return key == "LeavesQty" ? 151 : -1;
+    case fixhash("SecurityType"): return key == "SecurityType" ? 167 : -1;
+    case fixhash("MaturityMonthYear"): return key == "MaturityMonthYear" ? 200 : -1;
+    default: return -1;
+    }
+}
+
+enum
+{
+    STATIC_LOOKUPS = 10000000
+};
+
+// Tag name lookups, a quarter of them misses, in the static trie, a stringtrie of the
+// same names and a switch on the hash of the name
+void testStaticTrie()
+{
+    typedef static_stringtrie<fixtags> fixtag_trie;
+    stringtrie<int> tree;
+    vector<string> names;
+    for (size_t i = 0; i < sizeof(fixtags) / sizeof(fixtags[0]); ++i)
+    {
+        string key(fixtags[i].first);
+        tree.insert(stringtrie<int>::value_type(key, fixtags[i].second));
+        names.push_back(key);
+        if (i % 3 == 0)
+            names.push_back(key.substr(0, key.size() - 1));
+    }
+    vector<std::string_view> lookups;
+    srand(8);
+    for (int i = 0; i < STATIC_LOOKUPS; ++i)
+        lookups.push_back(names[rand() % names.size()]);
+
+    LARGE_INTEGER start;
+    long long sum1 = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < STATIC_LOOKUPS; ++i)
+    {
+        fixtag_trie::const_iterator it = fixtag_trie::find(lookups[i]);
+        sum1 += (it == fixtag_trie::end()) ? -1 : it->second;
+    }
+    double t1 = elapsed(start);
+
+    long long sum2 = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < STATIC_LOOKUPS; ++i)
+    {
+        stringtrie<int>::iterator it = tree.find(lookups[i].data(), lookups[i].size());
+        sum2 += (it == tree.end()) ? -1 : (*it).second;
+    }
+    double t2 = elapsed(start);
+
+    long long sum3 = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < STATIC_LOOKUPS; ++i)
+        sum3 += fixtagswitch(lookups[i]);
+    double t3 = elapsed(start);
+    assert(sum1 == sum2 && sum1 == sum3);
+
+    cout << "static trie: " << t1 / STATIC_LOOKUPS * 1000000000 << " nsec, stringtrie: " << t2 / STATIC_LOOKUPS * 1000000000
+        << " nsec, switch on hash: " << t3 / STATIC_LOOKUPS * 1000000000 << " nsec, checksum " << sum1 + sum2 + sum3 << endl;
+}
+
+enum
+{
+    RELAYOUT_KEYS = 200000
+    , RELAYOUT_LOOKUPS = 1000000
+    , RELAYOUT_SLICE = 1000
+};
+
+// Find latency percentiles and the time to iterate the whole trie
+void findlatency(stringtrie<int>& tree, vector<string>& keys, const char *name)
+{
+    vector<double> times;
+    times.reserve(RELAYOUT_LOOKUPS);
+    srand(10);
+    long long sum = 0;
+    LARGE_INTEGER start;
+    for (int i = 0; i < RELAYOUT_LOOKUPS; ++i)
+    {
+        const string& key = keys[((unsigned int)rand() * 31 + rand()) % keys.size()];
+        QueryPerformanceCounter(&start);
+        stringtrie<int>::iterator it = tree.find(key);
+        times.push_back(elapsed(start));
+        if (it != tree.end())
+            sum += (*it).second;
+    }
+    sort(times.begin(), times.end());
+
+    QueryPerformanceCounter(&start);
+    for (stringtrie<int>::iterator it = tree.begin(); it != tree.end(); ++it)
+        sum += (*it).second;
+    double iterate = elapsed(start);
+
+    cout << name << ": find p50 " << times[times.size() / 2] * 1000000000 << " nsec, p99 " << times[times.size() * 99 / 100] * 1000000000
+        << " nsec, p99.9 " << times[times.size() * 999 / 1000] * 1000000000 << " nsec, iterate " << iterate << " secs, checksum " << sum << endl;
+}
+
+// A trie after insert and erase churn, against the same trie after relayout(), and the
+// longest slice of RELAYOUT_SLICE nodes
+void testRelayout()
+{
+    vector<string> keys;
+    makekeys(keys, RELAYOUT_KEYS * 2, 9);
+    stringtrie<int> tree;
+    srand(11);
+    for (int round = 0; round < 4; ++round)
+    {
+        for (int i = 0; i < RELAYOUT_KEYS * 2; ++i)
+        {
+            const string& key = keys[((unsigned int)rand() * 31 + rand()) % keys.size()];
+            if (rand() % 2)
+                tree.insert(stringtrie<int>::value_type(key, i));
+            else
+                tree.erase(key);
+        }
+    }
+    findlatency(tree, keys, "after churn");
+
+    stringtrie<int> copy(tree);
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    tree.relayout();
+    double t = elapsed(start);
+    findlatency(tree, keys, "after relayout");
+
+    double maxslice = 0;
+    int nslices = 0;
+    bool bDone = false;
+    while (bDone == false)
+    {
+        QueryPerformanceCounter(&start);
+        bDone = copy.relayout(RELAYOUT_SLICE);
+        maxslice = max(maxslice, elapsed(start));
+        ++nslices;
+    }
+    cout << "relayout: " << tree.getnumnodes() << " nodes, " << t << " secs, " << nslices << " slices of " << RELAYOUT_SLICE
+        << " nodes, longest " << maxslice * 1000000 << " usec" << endl;
+}
+
+enum
+{
+    TOPK_KEYS = 1000000
+    , TOPK_QUERIES = 10000
+    , TOPK_K = 10
+};
+
+// Symbol autocomplete ranked by volume: top_k() against walking the keys with the prefix
+// and sorting them, for prefixes of one, two and three characters. The inserts leave every
+// score stale, so the time the first top_k() takes to compute the scores of the whole trie
+// is shown on its own.
+void testTopK()
+{
+    typedef stringtrie<int, stringtrie_scored_traits> trie_type;
+    vector<string> keys;
+    makekeys(keys, TOPK_KEYS, 12);
+    trie_type tree;
+    srand(13);
+    for (int i = 0; i < TOPK_KEYS; ++i)
+        tree.insert(trie_type::value_type(keys[i], ((unsigned int)rand() * 31 + rand()) % 10000000));
+
+    vector<string> prefixes[3];
+    for (int len = 1; len <= 3; ++len)
+    {
+        for (int i = 0; i < TOPK_QUERIES; ++i)
+            prefixes[len - 1].push_back(keys[((unsigned int)rand() * 31 + rand()) % keys.size()].substr(0, len));
+    }
+
+    long long sum = 0;
+    double walk[3];
+    vector<pair<int, trie_type::iterator> > all;
+    LARGE_INTEGER start;
+    for (int len = 1; len <= 3; ++len)
+    {
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < TOPK_QUERIES; ++i)
+        {
+            const string& prefix = prefixes[len - 1][i];
+            all.clear();
+            for (trie_type::iterator it = tree.lower_bound(prefix); it != tree.end() && (*it).first.compare(0, prefix.length(), prefix) == 0; ++it)
+                all.push_back(pair<int, trie_type::iterator>((*it).second, it));
+            size_t n = min(all.size(), (size_t)TOPK_K);
+            partial_sort(all.begin(), all.begin() + n, all.end(), [](const pair<int, trie_type::iterator>& a, const pair<int, trie_type::iterator>& b) { return a.first > b.first; });
+            for (size_t j = 0; j < n; ++j)
+                sum -= all[j].first;
+        }
+        walk[len - 1] = elapsed(start);
+    }
+
+    QueryPerformanceCounter(&start);
+    tree.top_k("", 1);
+    cout << "top_k: " << tree.size() << " keys, scores recomputed in " << elapsed(start) << " secs" << endl;
+
+    for (int len = 1; len <= 3; ++len)
+    {
+        QueryPerformanceCounter(&start);
+        for (int i = 0; i < TOPK_QUERIES; ++i)
+        {
+            vector<trie_type::iterator> best = tree.top_k(prefixes[len - 1][i], TOPK_K);
+            for (size_t j = 0; j < best.size(); ++j)
+                sum += (*best[j]).second;
+        }
+        double t = elapsed(start);
+        cout << "prefix length " << len << ": top_k " << t / TOPK_QUERIES * 1000000 << " usec, walk and sort "
+            << walk[len - 1] / TOPK_QUERIES * 1000000 << " usec" << endl;
+    }
+    cout << "checksum " << sum << endl;
+}
+
+enum
+{
+    BURST_KEYS = 500000
+    , BURST_LOOKUPS = 2000000
+};
+
+// Memory and the mean find() time of one trie type on a set of keys
+template<typename Trie>
+void burstrun(vector<string>& keys, const char *name)
+{
+    Trie tree;
+    for (size_t i = 0; i < keys.size(); ++i)
+        tree.insert(typename Trie::value_type(keys[i], (int)i));
+    srand(14);
+    long long sum = 0;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < BURST_LOOKUPS; ++i)
+    {
+        typename Trie::iterator it = tree.find(keys[((unsigned int)rand() * 31 + rand()) % keys.size()]);
+        if (it != tree.end())
+            sum += (*it).second;
+    }
+    double t = elapsed(start);
+    cout << name << ": " << tree.getnumnodes() << " nodes, mem " << tree.getmemusage() / (1024 * 1024) << " MB, find "
+        << t / BURST_LOOKUPS * 1000000000 << " nsec, checksum " << sum << endl;
+}
+
+// Tables in every node against burst mode on instrument symbols, URLs and UUIDs
+void testBurst()
+{
+    vector<string> keys;
+    makekeys(keys, BURST_KEYS, 15);
+    burstrun<stringtrie<int> >(keys, "symbols, tables");
+    burstrun<stringtrie<int, stringtrie_burst_traits> >(keys, "symbols, burst");
+    makeurls(keys, BURST_KEYS, 16);
+    burstrun<stringtrie<int> >(keys, "urls, tables");
+    burstrun<stringtrie<int, stringtrie_burst_traits> >(keys, "urls, burst");
+    makeuuids(keys, BURST_KEYS, 17);
+    burstrun<stringtrie<int> >(keys, "uuids, tables");
+    burstrun<stringtrie<int, stringtrie_burst_traits> >(keys, "uuids, burst");
+}
+
+enum
+{
+    NORMALIZE_KEYS = 5000
+    , NORMALIZE_LOOKUPS = 10000000
+};
+
+// What a caller does without normalized keys, a new string for every lookup
+string normalizesymbol(const string& r)
+{
+    string normal;
+    for (size_t j = 0; j < r.size(); ++j)
+    {
+        if (stringtrie_normalized_traits::ignore(r[j]) == false)
+            normal += stringtrie_normalized_traits::fold(r[j]);
+    }
+    return normal;
+}
+
+// Venue symbols in mixed case and with separators: a trie with normalized keys searched
+// with the raw symbol, against building the normalized symbol and searching a plain trie,
+// and against a plain trie searched with symbols that are already normalized
+void testNormalize()
+{
+    vector<string> keys;
+    makekeys(keys, NORMALIZE_KEYS, 18);
+    vector<string> raw;
+    srand(19);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        string r;
+        for (size_t j = 0; j < keys[i].size(); ++j)
+        {
+            char c = keys[i][j];
+            if (c == ' ')
+                c = " -/"[rand() % 3];
+            else if (rand() % 2)
+                c = (char)tolower(c);
+            r += c;
+        }
+        raw.push_back(r);
+    }
+
+    stringtrie<int> plain;
+    stringtrie<int, stringtrie_normalized_traits> normalized;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        plain.insert(stringtrie<int>::value_type(normalizesymbol(raw[i]), (int)i));
+        normalized.insert(stringtrie<int, stringtrie_normalized_traits>::value_type(raw[i], (int)i));
+    }
+
+    vector<int> order;
+    for (int i = 0; i < NORMALIZE_LOOKUPS; ++i)
+        order.push_back(((unsigned int)rand() * 31 + rand()) % keys.size());
+
+    long long sum1 = 0;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < NORMALIZE_LOOKUPS; ++i)
+    {
+        stringtrie<int, stringtrie_normalized_traits>::iterator it = normalized.find(raw[order[i]]);
+        if (it != normalized.end())
+            sum1 += (*it).second;
+    }
+    double t1 = elapsed(start);
+
+    long long sum2 = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < NORMALIZE_LOOKUPS; ++i)
+    {
+        stringtrie<int>::iterator it = plain.find(normalizesymbol(raw[order[i]]));
+        if (it != plain.end())
+            sum2 += (*it).second;
+    }
+    double t2 = elapsed(start);
+
+    vector<string> normals;
+    for (stringtrie<int>::iterator it = plain.begin(); it != plain.end(); ++it)
+        normals.push_back((*it).first);
+    long long sum3 = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < NORMALIZE_LOOKUPS; ++i)
+    {
+        stringtrie<int>::iterator it = plain.find(normals[order[i]]);
+        if (it != plain.end())
+            sum3 += (*it).second;
+    }
+    double t3 = elapsed(start);
+    cout << "normalized trie: " << t1 / NORMALIZE_LOOKUPS * 1000000000 << " nsec, normalize then find: " << t2 / NORMALIZE_LOOKUPS * 1000000000
+        << " nsec, find of normalized keys: " << t3 / NORMALIZE_LOOKUPS * 1000000000 << " nsec, checksum " << sum1 - sum2 << " " << sum3 << endl;
+}
+
+enum
+{
+    ORDER_KEYS = 250000
+    , ORDER_LOOKUPS = 10000000
+};
+
+// Order ID lookups: the trie keyed on uint64_t against unordered_map<uint64_t>, and
+// against the same trie searched with the variable length descent. The IDs are
+// allocated in blocks per session, with gaps, as an exchange gateway does.
+void testIntegerKeys()
+{
+    typedef stringtrie<int, stringtrie_keyed_traits<unsigned long long> > trie_type;
+    vector<unsigned long long> ids;
+    srand(6);
+    unsigned long long id = 0x0001000000000000ULL;
+    while ((int)ids.size() < ORDER_KEYS)
+    {
+        if (rand() % 1000 == 0)
+            id += (unsigned long long)rand() << 20;
+        id += 1 + rand() % 4;
+        ids.push_back(id);
+    }
+    vector<unsigned long long> lookups;
+    for (int i = 0; i < ORDER_LOOKUPS; ++i)
+        lookups.push_back(ids[((unsigned int)rand() * 31 + rand()) % ORDER_KEYS]);
+
+    trie_type tree;
+    unordered_map<unsigned long long, int> m;
+    for (int i = 0; i < ORDER_KEYS; ++i)
+    {
+        tree.insert(trie_type::value_type(ids[i], i));
+        m[ids[i]] = i;
+    }
+
+    LARGE_INTEGER start;
+    long long sum1 = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < ORDER_LOOKUPS; ++i)
+        sum1 += (*tree.find(lookups[i])).second;
+    double t1 = elapsed(start);
+
+    long long sum2 = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < ORDER_LOOKUPS; ++i)
+    {
+        trie_type::key_traits::bytes b(lookups[i]);
+        sum2 += (*tree.find(b.data(), b.size())).second;
+    }
+    double t2 = elapsed(start);
+
+    long long sum3 = 0;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < ORDER_LOOKUPS; ++i)
+        sum3 += m.find(lookups[i])->second;
+    double t3 = elapsed(start);
+    assert(sum1 == sum3 && sum2 == sum3);
+
+    cout << "uint64 keys: " << ORDER_KEYS << ", nodes: " << tree.getnumnodes() << ", mem: " << tree.getmemusage() << endl;
+    cout << "trie fixed length find: " << t1 / ORDER_LOOKUPS * 1000000000 << " nsec" << endl;
+    cout << "trie variable length find: " << t2 / ORDER_LOOKUPS * 1000000000 << " nsec" << endl;
+    cout << "unordered_map find: " << t3 / ORDER_LOOKUPS * 1000000000 << " nsec, checksum " << sum1 + sum2 + sum3 << endl;
+}
+
+enum
+{
+    BULK_KEYS = 100000
+};
+
+// Erasing BULK_KEYS keys under one prefix, among as many other keys, with
+// erase_prefix(), with erase(first, last) and one key at a time
+void testBulkErase()
+{
+    vector<string> others;
+    makekeys(others, BULK_KEYS, 5);
+    vector<string> keys;
+    for (int i = 0; i < BULK_KEYS; ++i)
+    {
+        char buf[32];
+        sprintf(buf, "ESZ5 %c%d", "CP"[i % 2], i);
+        keys.push_back(buf);
+    }
+    stringtrie<int> orig;
+    for (int i = 0; i < BULK_KEYS; ++i)
+    {
+        orig.insert(stringtrie<int>::value_type(keys[i], i));
+        orig.insert(stringtrie<int>::value_type(others[i], i));
+    }
+    // Copies, so the three tries have the same memory layout
+    stringtrie<int> tree(orig);
+    stringtrie<int> tree2(orig);
+    stringtrie<int> tree3(orig);
+
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    size_t n = tree.erase_prefix("ESZ5");
+    double t1 = elapsed(start);
+
+    QueryPerformanceCounter(&start);
+    tree2.erase(tree2.lower_bound("ESZ5"), tree2.lower_bound("ESZ6"));
+    double t2 = elapsed(start);
+
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < BULK_KEYS; ++i)
+        tree3.erase(keys[i]);
+    double t3 = elapsed(start);
+    assert(n == BULK_KEYS && tree.size() == tree3.size() && tree2.size() == tree3.size());
+    assert(tree.getnumnodes() == tree3.getnumnodes());
+
+    cout << "erase_prefix: " << t1 << " secs, erase(first, last): " << t2 << " secs, erase each key: " << t3 << " secs" << endl;
+}
+
+enum
+{
+    SCAN_KEYS = 100000
+    , SCAN_TEXT = 64 * 1024 * 1024
+    , SCAN_STRFIND_KEYS = 100       // std::string::find is timed on this many keys and scaled up
+};
+
+struct scancount
+{
+    scancount(size_t& n) : nmatches(n) {}
+    void operator()(size_t, size_t, const int&) { ++nmatches; }
+    size_t& nmatches;
+};
+
+// scan() against calling find() at every offset for each key length, and against a
+// std::string::find loop for each key. The text is random words with a key about
+// every 100 bytes.
+void testScan()
+{
+    vector<string> keys;
+    makekeys(keys, SCAN_KEYS, 3);
+    stringtrie<int, stringtrie_scan_traits> tree;
+    size_t lengths[64] = {0};
+    for (int i = 0; i < SCAN_KEYS; ++i)
+    {
+        tree.insert(stringtrie<int, stringtrie_scan_traits>::value_type(keys[i], i));
+        lengths[keys[i].size()] = 1;
+    }
+
+    string text;
+    text.reserve(SCAN_TEXT + 64);
+    srand(4);
+    while (text.size() < SCAN_TEXT)
+    {
+        if (rand() % 16 == 0)
+            text += keys[rand() % SCAN_KEYS];
+        else
+            text.append("abcdefghijklmnopqrstuvwxyz" + rand() % 20, 1 + rand() % 6);
+        text += ' ';
+    }
+
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    tree.buildlinks();
+    double build = elapsed(start);
+
+    size_t n1 = 0;
+    QueryPerformanceCounter(&start);
+    tree.scan(text, scancount(n1));
+    double t1 = elapsed(start);
+
+    size_t n2 = 0;
+    QueryPerformanceCounter(&start);
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        for (size_t len = 1; len < 64 && i + len <= text.size(); ++len)
+        {
+            if (lengths[len] && tree.find(text.data() + i, len) != tree.end())
+                ++n2;
+        }
+    }
+    double t2 = elapsed(start);
+    assert(n1 == n2);
+
+    size_t n3 = 0;
+    QueryPerformanceCounter(&start);
+    for (int k = 0; k < SCAN_STRFIND_KEYS; ++k)
+    {
+        for (size_t pos = text.find(keys[k]); pos != string::npos; pos = text.find(keys[k], pos + 1))
+            ++n3;
+    }
+    double t3 = elapsed(start) * SCAN_KEYS / SCAN_STRFIND_KEYS;
+
+    double gb = text.size() / 1000000000.0;
+    cout << "scan: " << text.size() << " bytes, " << SCAN_KEYS << " keys, " << n1 << " matches, links built in " << build << " secs" << endl;
+    cout << "scan: " << t1 << " secs, " << gb / t1 << " GB/s" << endl;
+    cout << "find at every offset: " << t2 << " secs, " << gb / t2 << " GB/s" << endl;
+    cout << "string::find per key (estimated): " << t3 << " secs, " << gb / t3 << " GB/s" << endl;
 }
 
 void performancetest()
@@ -378,5 +2579,33 @@ int _tmain(int argc, _TCHAR* argv[])
 {
     BasicTest bt;
     bt.test();
+    OrderedTest ot;
+    ot.test();
+    CountTest ct;
+    ct.test();
+    SnapshotTest st;
+    st.test();
+    SetTest sett;
+    sett.test();
+    LoaderTest lt;
+    lt.test();
+    LogTest logt;
+    logt.test();
+    ScanTest scant;
+    scant.test();
+    BulkEraseTest bet;
+    bet.test();
+    KeyTest kt;
+    kt.test();
+    StaticTest statict;
+    statict.test();
+    RelayoutTest rt;
+    rt.test();
+    TopKTest topkt;
+    topkt.test();
+    BurstTest burstt;
+    burstt.test();
+    NormalizeTest normalt;
+    normalt.test();
     return 0;
 }